@@ -0,0 +1,60 @@
+#!/bin/sh
+# Time config load + dependency resolution (--print-order) of the legacy
+# C++ binary on generated configs, with and without the compiled config cache.
+#
+# usage: bench-config-scale.sh <timevault-binary> [job-counts...]
+#   g++ -std=c++17 -O2 -pthread legacy/timevault.cpp -lyaml-cpp -lz -o /tmp/timevault
+#   legacy/bench-config-scale.sh /tmp/timevault 100 1000 10000
+set -eu
+
+bin=${1:?usage: bench-config-scale.sh <timevault-binary> [job-counts...]}
+shift
+[ $# -gt 0 ] || set -- 100 1000 10000
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gen_config() {
+  # Jobs depend on later jobs in the file (job i on job i+1 within a group of
+  # 50, each group's tail on the next group's tail), the worst case for a
+  # pass-based sort, spread over 6 disks.
+  awk -v n="$1" 'BEGIN {
+    print "jobs:"
+    for (i = 0; i < n; i++) {
+      disk = i % 6
+      printf "  - name: job%05d\n", i
+      printf "    source: /srv/data/%05d/\n", i
+      printf "    dest: /mnt/backup%d/job%05d\n", disk, i
+      printf "    mount: /mnt/backup%d\n", disk
+      printf "    copies: 7\n"
+      if (i % 50 != 49 && i + 1 < n) {
+        printf "    depends_on:\n      - job%05d\n", i + 1
+      } else if (i % 50 == 49 && i + 50 < n) {
+        printf "    depends_on:\n      - job%05d\n", i + 50
+      }
+    }
+  }'
+}
+
+time_print_order() {
+  start=$(date +%s.%N)
+  "$bin" --config "$1" --print-order > /dev/null
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }'
+}
+
+# cold parses the YAML; --print-order never writes the cache, so
+# --compile-config writes <config>.cache before warm loads that image.
+printf "jobs,cold_seconds,warm_seconds\n"
+for n in "$@"; do
+  cfg="$work/timevault-$n.yaml"
+  gen_config "$n" > "$cfg"
+  cold=$(time_print_order "$cfg")
+  "$bin" --config "$cfg" --compile-config > /dev/null
+  if [ ! -f "$cfg.cache" ]; then
+    echo "no compiled config written for $cfg" >&2
+    exit 1
+  fi
+  warm=$(time_print_order "$cfg")
+  printf "%s,%s,%s\n" "$n" "$cold" "$warm"
+done
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Time full backup runs (mount, verify, expire, clone, rsync, umount) of the
+# legacy C++ binary inside --sandbox, so no root, fstab entries or disks are
+# needed. Each run gets fresh tmpfs disks seeded (via <sandbox>/seed) with
+# [seed-days] hard-linked snapshots and a current link per job, so expire
+# and clone have real work. seconds includes copying the seed in; the
+# expire and clone columns are summed over jobs from --report-json, and the
+# full reports are left in the work directory with --keep.
+#
+# usage: bench-sandbox.sh <timevault-binary> [jobs] [disks] [files-per-job] [runs] [seed-days] [--keep]
+#   g++ -std=c++17 -O2 -pthread legacy/timevault.cpp -lyaml-cpp -lz -o /tmp/timevault
+#   legacy/bench-sandbox.sh /tmp/timevault 12 3 2000 5
+set -eu
+
+bin=${1:?usage: bench-sandbox.sh <timevault-binary> [jobs] [disks] [files-per-job] [runs] [seed-days] [--keep]}
+jobs=${2:-6}
+disks=${3:-2}
+files=${4:-1000}
+runs=${5:-3}
+days=${6:-4}
+keep=${7:-}
+
+work=$(mktemp -d)
+if [ "$keep" = "--keep" ]; then
+  echo "work directory: $work" >&2
+else
+  trap 'rm -rf "$work"' EXIT
+fi
+
+# Sources must belong to the invoking user: other owners are unmapped in
+# the sandbox's user namespace and rsync cannot preserve them.
+for j in $(seq 0 $((jobs - 1))); do
+  dir="$work/src/job$j"
+  mkdir -p "$dir"
+  awk -v n="$files" -v d="$dir" 'BEGIN {
+    for (i = 0; i < n; i++) {
+      sub_dir = d "/" (i % 16)
+      if (i < 16) system("mkdir -p " sub_dir)
+      printf "%0" (64 + (i * 37) % 4096) "d\n", i > (sub_dir "/f" i)
+      close(sub_dir "/f" i)
+    }
+  }'
+done
+
+# Snapshots 202001DD are older than any real backup day, so each run
+# expires down to copies and clones the newest of them.
+for j in $(seq 0 $((jobs - 1))); do
+  dest="$work/sandbox/seed/disk$((j % disks))/job$j"
+  mkdir -p "$dest"
+  prev=
+  for d in $(seq 1 "$days"); do
+    day=$(printf "202001%02d" "$d")
+    if [ -z "$prev" ]; then
+      cp -a "$work/src/job$j/." "$dest/$day"
+    else
+      cp -al "$dest/$prev" "$dest/$day"
+    fi
+    prev=$day
+  done
+  ln -s "$prev" "$dest/current"
+done
+
+awk -v n="$jobs" -v disks="$disks" -v w="$work" 'BEGIN {
+  print "jobs:"
+  for (i = 0; i < n; i++) {
+    disk = i % disks
+    printf "  - name: job%d\n", i
+    printf "    source: %s/src/job%d/\n", w, i
+    printf "    dest: %s/sandbox/mnt/disk%d/job%d\n", w, disk, i
+    printf "    mount: %s/sandbox/mnt/disk%d\n", w, disk
+    printf "    copies: 3\n"
+  }
+}' > "$work/timevault.yaml"
+
+# Sums one phase's duration_sec over all jobs in a report.
+phase_sum() {
+  grep -o "\"name\": \"$1\", \"start_sec\": [0-9.]*, \"duration_sec\": [0-9.]*" "$2" |
+    awk '{ s += $NF } END { printf "%.3f", s }'
+}
+
+printf "run,seconds,expire_sec,clone_sec,exit_code\n"
+for r in $(seq 1 "$runs"); do
+  start=$(date +%s.%N)
+  rc=0
+  "$bin" --sandbox "$work/sandbox" --config "$work/timevault.yaml" \
+    --report-json "$work/report-$r.json" > "$work/run-$r.log" 2>&1 || rc=$?
+  end=$(date +%s.%N)
+  expire=$(phase_sum expire "$work/report-$r.json")
+  clone=$(phase_sum clone "$work/report-$r.json")
+  awk -v r="$r" -v s="$start" -v e="$end" -v x="$expire" -v c="$clone" -v rc="$rc" \
+    'BEGIN { printf "%d,%.3f,%s,%s,%d\n", r, e - s, x, c, rc }'
+done
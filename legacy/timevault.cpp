@@ -1,28 +1,57 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <ctime>
 #include <csignal>
 #include <fcntl.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <ftw.h>
 #include <limits.h>
+#include <poll.h>
+#include <map>
+#include <queue>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <yaml-cpp/yaml.h>
+#include <zlib.h>
+#ifdef TIMEVAULT_WITH_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
 
 static const char *LOCK_FILE = "/var/run/timevault.pid";
+static const char *LOCK_DIR = "/var/run";
 static const char *DEFAULT_CONFIG = "/etc/timevault.yaml";
+static const char *DEFAULT_HISTORY = "/var/lib/timevault/history";
+static const char *DEFAULT_RUNTIME_DIR = "/run/timevault";
+static const char *FSTAB_PATH = "/etc/fstab";
+static const char *MOUNTS_PATH = "/proc/mounts";
 static const char *TIMEVAULT_MARKER = ".timevault";
 static const char *TIMEVAULT_VERSION = "0.1.0";
 static const char *TIMEVAULT_LICENSE = "GNU GPL v3 or later";
@@ -30,11 +59,20 @@ static const char *TIMEVAULT_COPYRIGHT = "Copyright (C) 2025 John Allen (john.jo
 static const char *TIMEVAULT_PROJECT_URL = "https://github.com/johnjoeallen/timevault";
 
 static std::vector<std::string> tracked_mounts;
+static std::mutex tracked_mounts_mutex;
+
+enum class SchedulePolicy {
+    CriticalPath,
+    LongestFirst,
+    ConfigOrder
+};
 
 struct RunMode {
     bool dry_run = false;
     bool safe_mode = false;
     bool verbose = false;
+    int lock_wait_sec = 0;
+    SchedulePolicy schedule = SchedulePolicy::CriticalPath;
 };
 
 enum class RunPolicy {
@@ -50,16 +88,460 @@ struct Job {
     int copies = 0;
     std::string mount;
     RunPolicy run_policy = RunPolicy::Auto;
-    std::vector<std::string> excludes;
+    int exclude_set = 0;
+    std::string schedule;
     std::vector<std::string> depends_on;
 };
 
+struct ConcurrencyLimits {
+    int jobs = 1;
+    int per_disk = 1;
+    int per_source = 1;
+    int per_host = 1;
+};
+
 struct Config {
     std::vector<Job> jobs;
     std::vector<std::string> excludes;
+    std::vector<std::vector<std::string>> exclude_sets;
     std::string mount_prefix;
+    bool lock_source_device = false;
+    bool manifests = false;
+    bool manifest_hashes = false;
+    ConcurrencyLimits limits;
+    std::string history_path = DEFAULT_HISTORY;
+    std::string runtime_dir = DEFAULT_RUNTIME_DIR;
+    std::string prometheus_textfile;
+};
+
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+}
+
+struct TraceEvent {
+    std::string name;
+    const char *category;
+    double start_sec;
+    double duration_sec;
+    int tid;
+    std::vector<std::pair<std::string, std::string>> args;
+};
+
+// Events for --trace, one track per thread. Recording is a no-op unless
+// trace_enabled is set, so the hooks cost nothing in normal runs.
+static bool trace_enabled = false;
+static double trace_started = 0.0;
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+static std::map<int, std::string> trace_threads;
+static std::atomic<int> trace_next_tid(0);
+static thread_local int trace_tid = -1;
+
+static int trace_thread_id() {
+    if (trace_tid < 0) trace_tid = trace_next_tid++;
+    return trace_tid;
+}
+
+static void trace_thread_name(const std::string &name) {
+    if (!trace_enabled) return;
+    int tid = trace_thread_id();
+    std::lock_guard<std::mutex> guard(trace_mutex);
+    trace_threads[tid] = name;
+}
+
+static void trace_event(
+    const std::string &name,
+    const char *category,
+    double start_sec,
+    std::vector<std::pair<std::string, std::string>> args = {}
+) {
+    if (!trace_enabled) return;
+    TraceEvent ev;
+    ev.name = name;
+    ev.category = category;
+    ev.start_sec = start_sec;
+    ev.duration_sec = monotonic_seconds() - start_sec;
+    ev.tid = trace_thread_id();
+    ev.args = std::move(args);
+    std::lock_guard<std::mutex> guard(trace_mutex);
+    trace_events.push_back(std::move(ev));
+}
+
+struct PhaseSpan {
+    std::string name;
+    double start_sec = 0.0;
+    double duration_sec = 0.0;
+};
+
+struct ChildUsage {
+    double user_sec = 0.0;
+    double sys_sec = 0.0;
+    long max_rss_kb = 0;
+    long block_in = 0;
+    long block_out = 0;
+    long voluntary_switches = 0;
+    long involuntary_switches = 0;
+    int processes = 0;
+};
+
+struct JobStatus {
+    std::string state;
+    std::string phase;
+    double started = 0.0;
+    double estimate_sec = 0.0;
+    pid_t child = 0;
+    bool cancel = false;
+    std::vector<PhaseSpan> spans;
+    ChildUsage usage;
+};
+
+// Live state of the jobs in the current run, read by the control socket.
+// Workers report through active_job, the job the calling thread is running;
+// spans recorded with no active job (mount sessions closed between jobs)
+// belong to the run.
+static std::mutex job_status_mutex;
+static std::map<std::string, JobStatus> job_status;
+static std::vector<PhaseSpan> run_spans;
+static double run_started = 0.0;
+static thread_local std::string active_job;
+
+static void job_status_set(const std::string &name, const char *state) {
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    job_status[name].state = state;
+}
+
+static double phase_begin(const char *phase) {
+    if (!active_job.empty()) {
+        std::lock_guard<std::mutex> guard(job_status_mutex);
+        job_status[active_job].phase = phase;
+    }
+    return monotonic_seconds();
+}
+
+static void phase_end(const char *phase, double started) {
+    PhaseSpan span;
+    span.name = phase;
+    span.start_sec = started;
+    span.duration_sec = monotonic_seconds() - started;
+    if (active_job.empty()) {
+        trace_event(phase, "phase", started);
+    } else {
+        trace_event(phase, "phase", started, {{"job", active_job}});
+    }
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    if (active_job.empty()) {
+        run_spans.push_back(span);
+    } else {
+        job_status[active_job].spans.push_back(span);
+    }
+}
+
+// Set once to cancel every job of the run, as if each were cancelled
+// over the control socket.
+static bool run_cancel = false;
+
+static void job_child(pid_t pid) {
+    if (active_job.empty()) return;
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    JobStatus &status = job_status[active_job];
+    status.child = pid;
+    if (pid > 0 && (status.cancel || run_cancel)) kill(pid, SIGTERM);
+}
+
+static void job_child_done(const struct rusage &ru) {
+    if (active_job.empty()) return;
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    JobStatus &status = job_status[active_job];
+    status.child = 0;
+    ChildUsage &usage = status.usage;
+    usage.user_sec += static_cast<double>(ru.ru_utime.tv_sec) + static_cast<double>(ru.ru_utime.tv_usec) / 1e6;
+    usage.sys_sec += static_cast<double>(ru.ru_stime.tv_sec) + static_cast<double>(ru.ru_stime.tv_usec) / 1e6;
+    usage.max_rss_kb = std::max(usage.max_rss_kb, ru.ru_maxrss);
+    usage.block_in += ru.ru_inblock;
+    usage.block_out += ru.ru_oublock;
+    usage.voluntary_switches += ru.ru_nvcsw;
+    usage.involuntary_switches += ru.ru_nivcsw;
+    usage.processes++;
+}
+
+static bool job_cancelled(const std::string &name) {
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    if (run_cancel) return true;
+    auto it = job_status.find(name);
+    return it != job_status.end() && it->second.cancel;
+}
+
+static void cancel_run() {
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    run_cancel = true;
+    for (auto &entry : job_status) {
+        if (entry.second.child > 0) kill(entry.second.child, SIGTERM);
+    }
+}
+
+// Every external command goes through run_command_output. --record logs
+// each one (argv, wall time, exit code, captured output) as it runs for
+// real; --replay executes nothing and answers from such a log instead,
+// sleeping for the recorded time scaled by --replay-speed. While replaying,
+// mount state comes from the replayed mount/umount commands rather than
+// /proc/mounts and /etc/fstab, so scheduler and mount-session logic can be
+// driven at scale on any host. Replay needs --sandbox: the rest of a run
+// (expiry, snapshot dirs, current, manifests, history) still writes, and
+// there it lands on tmpfs mounted over each job mount.
+enum class ExecutorMode {
+    Real,
+    Record,
+    Replay
+};
+
+struct CommandRecord {
+    double seconds = 0.0;
+    int exit_code = 0;
+    std::string output;
+    bool used = false;
+};
+
+struct CommandExecutor {
+    ExecutorMode mode = ExecutorMode::Real;
+    double speed = 1.0;
+    std::mutex mutex;
+    FILE *log = nullptr;
+    std::vector<CommandRecord> records;
+    std::unordered_map<std::string, std::deque<size_t>> by_argv;
+    std::unordered_map<std::string, std::deque<size_t>> by_shape;
+    std::unordered_set<std::string> fstab;
+    std::unordered_map<std::string, bool> mounted;
+    long exact = 0;
+    long shaped = 0;
+    long missed = 0;
 };
 
+static CommandExecutor executor;
+
+static const char *COMMAND_LOG_HEADER = "# timevault command log v1";
+
+static std::string command_log_escape(const std::string &text) {
+    std::string out;
+    out.reserve(text.size());
+    for (char c : text) {
+        if (c == '\\') {
+            out += "\\\\";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+static std::string command_log_unescape(const std::string &text) {
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] != '\\' || i + 1 == text.size()) {
+            out.push_back(text[i]);
+            continue;
+        }
+        char c = text[++i];
+        out.push_back(c == 't' ? '\t' : c == 'n' ? '\n' : c);
+    }
+    return out;
+}
+
+// The program a command line runs, looking through the nice/ionice prefix
+// run_nice_ionice adds.
+static size_t command_program(const std::vector<std::string> &argv) {
+    return argv.size() > 7 && argv[0] == "nice" ? 7 : 0;
+}
+
+static std::string command_key(const std::vector<std::string> &argv) {
+    std::string key;
+    for (const auto &arg : argv) {
+        key += command_log_escape(arg);
+        key.push_back('\t');
+    }
+    return key;
+}
+
+// The program, its options without =values, and the number of operands:
+// day directories and exclude-file names change between runs, but a
+// remount never stands in for a plain mount.
+static std::string command_shape(const std::vector<std::string> &argv) {
+    size_t program = command_program(argv);
+    std::string key = command_log_escape(argv[program]) + "\t";
+    size_t operands = 0;
+    for (size_t i = program + 1; i < argv.size(); i++) {
+        if (argv[i].empty() || argv[i][0] != '-') {
+            operands++;
+            continue;
+        }
+        key += command_log_escape(argv[i].substr(0, argv[i].find('='))) + "\t";
+    }
+    return key + std::to_string(operands);
+}
+
+// One line per command: seconds, exit code, argc, argv..., output; fields
+// tab-separated and escaped.
+static void executor_record(const std::vector<std::string> &argv, double seconds, int rc, const std::string *output) {
+    std::string line = std::to_string(seconds) + "\t" + std::to_string(rc) + "\t" + std::to_string(argv.size()) + "\t";
+    line += command_key(argv);
+    if (output) line += command_log_escape(*output);
+    line.push_back('\n');
+    std::lock_guard<std::mutex> guard(executor.mutex);
+    std::fwrite(line.data(), 1, line.size(), executor.log);
+    std::fflush(executor.log);
+}
+
+static bool executor_load(const std::string &path, std::string *err) {
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (!f) {
+        *err = "cannot open " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    std::string line;
+    char buf[65536];
+    size_t line_no = 0;
+    bool ok = true;
+    while (ok && std::fgets(buf, sizeof(buf), f)) {
+        line += buf;
+        if (line.empty() || line.back() != '\n') {
+            if (!std::feof(f)) continue;
+        } else {
+            line.pop_back();
+        }
+        line_no++;
+        if (line_no == 1 && line != COMMAND_LOG_HEADER) {
+            *err = path + " is not a timevault command log";
+            ok = false;
+            break;
+        }
+        if (line_no == 1 || line.empty()) {
+            line.clear();
+            continue;
+        }
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (;;) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+            if (tab == std::string::npos) break;
+            start = tab + 1;
+        }
+        CommandRecord rec;
+        char *end = nullptr;
+        rec.seconds = fields.size() >= 3 ? std::strtod(fields[0].c_str(), &end) : -1.0;
+        long argc = fields.size() >= 3 ? std::strtol(fields[2].c_str(), nullptr, 10) : 0;
+        if (rec.seconds < 0.0 || argc < 1 || fields.size() != static_cast<size_t>(argc) + 4) {
+            *err = path + ":" + std::to_string(line_no) + ": malformed record";
+            ok = false;
+            break;
+        }
+        rec.exit_code = std::atoi(fields[1].c_str());
+        rec.output = command_log_unescape(fields.back());
+        std::vector<std::string> argv;
+        for (long i = 0; i < argc; i++) argv.push_back(command_log_unescape(fields[3 + i]));
+        if (argv[0] == "mount" && argv.size() == 2) executor.fstab.insert(argv[1]);
+        size_t index = executor.records.size();
+        executor.records.push_back(std::move(rec));
+        executor.by_argv[command_key(argv)].push_back(index);
+        executor.by_shape[command_shape(argv)].push_back(index);
+        line.clear();
+    }
+    std::fclose(f);
+    return ok;
+}
+
+static bool executor_open(ExecutorMode mode, const std::string &path, double speed, std::string *err) {
+    executor.mode = mode;
+    executor.speed = speed;
+    if (mode == ExecutorMode::Replay) return executor_load(path, err);
+    if (mode != ExecutorMode::Record) return true;
+    executor.log = std::fopen(path.c_str(), "we");
+    if (!executor.log) {
+        *err = "cannot create " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    std::fprintf(executor.log, "%s\n", COMMAND_LOG_HEADER);
+    return true;
+}
+
+// The mount table as replayed mount, remount and umount commands left it.
+static void executor_apply_mount(const std::vector<std::string> &argv) {
+    if (argv.size() != 2 && argv.size() != 3) return;
+    const std::string &target = argv.back();
+    if (argv[0] == "umount") {
+        executor.mounted.erase(target);
+    } else if (argv[0] == "mount" && argv.size() == 2) {
+        executor.mounted[target] = false;
+    } else if (argv[0] == "mount" && argv[1] == "-oremount,ro") {
+        executor.mounted[target] = true;
+    } else if (argv[0] == "mount" && argv[1] == "-oremount,rw") {
+        executor.mounted[target] = false;
+    }
+}
+
+// The first record in queue not yet answered through the other index.
+// Caller holds executor.mutex.
+static CommandRecord *executor_take(std::deque<size_t> *queue) {
+    while (!queue->empty()) {
+        CommandRecord &rec = executor.records[queue->front()];
+        queue->pop_front();
+        if (rec.used) continue;
+        rec.used = true;
+        return &rec;
+    }
+    return nullptr;
+}
+
+// Exact argv first; failing that the next recorded command of the same
+// shape (see command_shape). Each record answers once.
+static int executor_replay(const std::vector<std::string> &argv, std::string *output) {
+    CommandRecord rec;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> guard(executor.mutex);
+        CommandRecord *match = executor_take(&executor.by_argv[command_key(argv)]);
+        if (match) {
+            executor.exact++;
+        } else if ((match = executor_take(&executor.by_shape[command_shape(argv)])) != nullptr) {
+            executor.shaped++;
+        } else {
+            executor.missed++;
+        }
+        if (match) {
+            rec = *match;
+            found = true;
+        }
+        if (rec.exit_code == 0) executor_apply_mount(argv);
+    }
+    if (!found) {
+        std::printf("replay: no recorded result for %s, assuming success\n", argv[command_program(argv)].c_str());
+    }
+    if (executor.speed > 0.0 && rec.seconds > 0.0) {
+        usleep(static_cast<useconds_t>(rec.seconds / executor.speed * 1e6));
+    }
+    if (output) {
+        *output = rec.output;
+        std::fwrite(rec.output.data(), 1, rec.output.size(), stdout);
+    }
+    return rec.exit_code;
+}
+
+// Answers mount_is_mounted (1/0) or mount_is_readonly (1/0, -1 when not
+// mounted) from the replayed table; -2 when not replaying.
+static int executor_mount_state(const std::string &mount, bool readonly) {
+    if (executor.mode != ExecutorMode::Replay) return -2;
+    std::lock_guard<std::mutex> guard(executor.mutex);
+    auto it = executor.mounted.find(mount);
+    if (it == executor.mounted.end()) return readonly ? -1 : 0;
+    return readonly ? (it->second ? 1 : 0) : 1;
+}
+
 static void print_command(const std::vector<std::string> &argv, const RunMode &mode) {
     if (!mode.dry_run && !mode.verbose) return;
     for (size_t i = 0; i < argv.size(); i++) {
@@ -72,24 +554,79 @@ static void print_command(const std::vector<std::string> &argv, const RunMode &m
     std::printf("\n");
 }
 
-static int run_command(const std::vector<std::string> &argv, const RunMode &mode) {
+// When output is set, the child's stdout is captured into it while still
+// being echoed to ours.
+static int run_command_output(const std::vector<std::string> &argv, const RunMode &mode, std::string *output) {
     print_command(argv, mode);
+    if (executor.mode == ExecutorMode::Replay) return executor_replay(argv, output);
+    double started = monotonic_seconds();
     std::vector<char *> args;
     for (const auto &s : argv) {
         args.push_back(const_cast<char *>(s.c_str()));
     }
     args.push_back(nullptr);
 
+    int pipefd[2] = {-1, -1};
+    if (output && pipe2(pipefd, O_CLOEXEC) != 0) return 1;
+    std::fflush(stdout);
     pid_t pid = fork();
-    if (pid < 0) return 1;
+    if (pid < 0) {
+        if (output) {
+            ::close(pipefd[0]);
+            ::close(pipefd[1]);
+        }
+        return 1;
+    }
     if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        if (output) dup2(pipefd[1], STDOUT_FILENO);
         execvp(args[0], args.data());
         _exit(127);
     }
+    job_child(pid);
+    if (output) {
+        ::close(pipefd[1]);
+        char buf[4096];
+        for (;;) {
+            ssize_t n = ::read(pipefd[0], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            output->append(buf, static_cast<size_t>(n));
+            std::fwrite(buf, 1, static_cast<size_t>(n), stdout);
+        }
+        ::close(pipefd[0]);
+    }
     int status = 0;
-    if (waitpid(pid, &status, 0) < 0) return 1;
-    if (WIFEXITED(status)) return WEXITSTATUS(status);
-    return 1;
+    struct rusage ru;
+    pid_t waited = wait4(pid, &status, 0, &ru);
+    if (waited < 0) {
+        job_child(0);
+        return 1;
+    }
+    job_child_done(ru);
+    int rc = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    if (executor.mode == ExecutorMode::Record) {
+        executor_record(argv, monotonic_seconds() - started, rc, output);
+    }
+    if (trace_enabled) {
+        size_t cmd = command_program(argv);
+        std::string command;
+        for (const auto &arg : argv) {
+            if (!command.empty()) command += ' ';
+            command += arg;
+        }
+        std::vector<std::pair<std::string, std::string>> args = {
+            {"command", command}, {"pid", std::to_string(pid)}, {"exit", std::to_string(rc)}};
+        if (!active_job.empty()) args.emplace_back("job", active_job);
+        trace_event(argv[cmd], "process", started, std::move(args));
+    }
+    return rc;
+}
+
+static int run_command(const std::vector<std::string> &argv, const RunMode &mode) {
+    return run_command_output(argv, mode, nullptr);
 }
 
 static void print_banner() {
@@ -126,19 +663,21 @@ static void print_string_list(const char *label, const std::vector<std::string>
     std::printf("\n");
 }
 
-static void print_job_details(const Job &job) {
+static void print_job_details(const Job &job, const Config &cfg) {
     std::printf("job: %s\n", job.name.empty() ? "<unnamed>" : job.name.c_str());
     std::printf("  source: %s\n", job.source.c_str());
     std::printf("  dest: %s\n", job.dest.c_str());
     std::printf("  copies: %d\n", job.copies);
     std::printf("  mount: %s\n", job.mount.empty() ? "<unset>" : job.mount.c_str());
     std::printf("  run: %s\n", run_policy_label(job.run_policy));
+    std::printf("  schedule: %s\n", job.schedule.empty() ? "<none>" : job.schedule.c_str());
     print_string_list("depends_on", job.depends_on);
-    print_string_list("excludes", job.excludes);
+    print_string_list("excludes", cfg.exclude_sets[job.exclude_set]);
 }
 
 static void track_mount(const std::string &mount) {
     if (mount.empty()) return;
+    std::lock_guard<std::mutex> guard(tracked_mounts_mutex);
     if (std::find(tracked_mounts.begin(), tracked_mounts.end(), mount) != tracked_mounts.end()) {
         return;
     }
@@ -146,6 +685,7 @@ static void track_mount(const std::string &mount) {
 }
 
 static void untrack_mount(const std::string &mount) {
+    std::lock_guard<std::mutex> guard(tracked_mounts_mutex);
     auto it = std::find(tracked_mounts.begin(), tracked_mounts.end(), mount);
     if (it != tracked_mounts.end()) {
         tracked_mounts.erase(it);
@@ -153,156 +693,850 @@ static void untrack_mount(const std::string &mount) {
 }
 
 static void cleanup_mounts() {
+    if (executor.mode == ExecutorMode::Replay) return;
+    std::lock_guard<std::mutex> guard(tracked_mounts_mutex);
     for (const auto &mount : tracked_mounts) {
         umount(mount.c_str());
     }
     tracked_mounts.clear();
 }
 
-static void handle_signal(int signum) {
-    (void)signum;
+// SIGINT, SIGTERM and SIGHUP are blocked in every thread from the start of
+// main (commands get the default mask back before exec) and read from a
+// signalfd by signal_watch on a thread of its own, so what they set off
+// runs in normal context and may lock and walk tracked_mounts. Outside the
+// daemon each unmounts what is tracked and exits. The daemon stops after
+// its current run, whose jobs are cancelled so that it still closes its
+// mount sessions and records and reports the run; a second signal during
+// that unmounts and exits at once.
+static std::atomic<bool> daemon_running{false};
+static std::atomic<bool> daemon_busy{false};
+static std::atomic<bool> daemon_stop{false};
+static std::atomic<bool> daemon_reload{false};
+static std::atomic<int> daemon_wake_fd{-1};
+
+static sigset_t watched_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    return set;
+}
+
+static void signal_watch(int fd) {
+    struct signalfd_siginfo info;
+    while (::read(fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+        if (!daemon_running) break;
+        if (info.ssi_signo == SIGHUP) {
+            daemon_reload = true;
+        } else if (daemon_busy && daemon_stop) {
+            break;
+        } else {
+            if (daemon_busy) {
+                std::printf("stopping: cancelling running jobs\n");
+                std::fflush(stdout);
+                cancel_run();
+            }
+            daemon_stop = true;
+        }
+        int wake = daemon_wake_fd;
+        char byte = 1;
+        if (wake >= 0 && ::write(wake, &byte, 1) < 0) {
+            // Already readable; the loop wakes either way.
+        }
+    }
     cleanup_mounts();
     _exit(1);
 }
 
-static int run_nice_ionice(const std::vector<std::string> &args, const RunMode &mode) {
+// Blocks the watched signals in the calling thread, and so in every thread
+// it starts; with a watcher they are delivered through signal_watch.
+static void signals_block() {
+    sigset_t set = watched_signals();
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+// Started once main is done with unshare, which wants a single thread.
+static void signals_watch() {
+    sigset_t set = watched_signals();
+    int fd = signalfd(-1, &set, SFD_CLOEXEC);
+    if (fd < 0) {
+        std::printf("cannot watch signals: %s\n", std::strerror(errno));
+        pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+        return;
+    }
+    std::thread(signal_watch, fd).detach();
+}
+
+static int run_nice_ionice(const std::vector<std::string> &args, const RunMode &mode, std::string *output = nullptr) {
     std::vector<std::string> argv = {"nice", "-n", "19", "ionice", "-c", "3", "-n7"};
     argv.insert(argv.end(), args.begin(), args.end());
     if (mode.dry_run) {
         print_command(argv, mode);
         return 0;
     }
-    return run_command(argv, mode);
+    return run_command_output(argv, mode, output);
 }
 
-static int lock_file_path(const std::string &path) {
-    for (int attempt = 0; attempt < 3; attempt++) {
-        int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
-        if (fd >= 0) {
-            char buf[32];
-            int len = std::snprintf(buf, sizeof(buf), "%d\n", static_cast<int>(getpid()));
-            if (len <= 0 || ::write(fd, buf, static_cast<size_t>(len)) != len) {
-                ::close(fd);
-                ::unlink(path.c_str());
-                return -1;
-            }
-            ::close(fd);
-            return 1;
-        }
-        if (errno != EEXIST) return -1;
+struct RsyncStats {
+    long long files_transferred = -1;
+    long long bytes_transferred = -1;
+};
 
-        FILE *f = std::fopen(path.c_str(), "r");
-        if (!f) {
-            if (errno == ENOENT) {
-                continue;
-            }
-            return -1;
+static long long parse_stats_number(const std::string &text, const char *label) {
+    size_t pos = text.find(label);
+    if (pos == std::string::npos) return -1;
+    pos += std::strlen(label);
+    long long value = 0;
+    bool any = false;
+    for (; pos < text.size(); pos++) {
+        char c = text[pos];
+        if (c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            any = true;
+        } else if (c == ',' || c == '.' || (c == ' ' && !any)) {
+            continue;
+        } else {
+            break;
         }
+    }
+    return any ? value : -1;
+}
 
-        char buf[64] = {0};
-        pid_t pid = 0;
-        if (std::fgets(buf, sizeof(buf), f)) {
-            pid = static_cast<pid_t>(std::atoi(buf));
-        }
-        std::fclose(f);
+static RsyncStats parse_rsync_stats(const std::string &output) {
+    RsyncStats stats;
+    stats.files_transferred = parse_stats_number(output, "Number of regular files transferred:");
+    if (stats.files_transferred < 0) {
+        stats.files_transferred = parse_stats_number(output, "Number of files transferred:");
+    }
+    stats.bytes_transferred = parse_stats_number(output, "Total transferred file size:");
+    return stats;
+}
 
-        if (pid > 0) {
-            char proc_path[128];
-            std::snprintf(proc_path, sizeof(proc_path), "/proc/%d", pid);
-            if (access(proc_path, F_OK) == 0) {
-                return 0;
-            }
-        }
+struct FileLock {
+    int fd = -1;
+    std::string path;
+};
 
-        if (::unlink(LOCK_FILE) != 0) {
-            if (errno == ENOENT) {
-                continue;
-            }
+struct JobMetrics {
+    std::string name;
+    double lock_wait_sec = 0.0;
+    double duration_sec = 0.0;
+    long long files_transferred = -1;
+    long long bytes_transferred = -1;
+    std::string status;
+    int exit_code = -1;
+    std::vector<int> rsync_codes;
+    int snapshots_expired = 0;
+    long long bytes_reclaimed = 0;
+    int snapshots = -1;
+    long long disk_used_bytes = -1;
+    long long disk_free_bytes = -1;
+    std::map<std::string, long long> snapshot_unique_bytes;
+    std::vector<PhaseSpan> phases;
+    ChildUsage usage;
+};
+
+struct ResourceUsage {
+    std::string name;
+    int limit = 0;
+    int in_use = 0;
+    int peak = 0;
+};
+
+struct RunMetrics {
+    double started = 0.0;
+    long long started_at = 0;
+    double lock_wait_sec = 0.0;
+    std::vector<JobMetrics> jobs;
+    ConcurrencyLimits limits;
+    int workers = 0;
+    int steals = 0;
+    int mount_cycles = 0;
+    int mount_transitions = 0;
+    int baseline_transitions = 0;
+    std::vector<ResourceUsage> resources;
+    std::vector<PhaseSpan> phases;
+};
+
+static FileLock global_lock;
+
+// Returns 1 when the lock is held, 0 when another holder kept it past
+// timeout_sec (negative waits forever), -1 on error with errno set.
+// OFD locks belong to the open file description, so the kernel drops them
+// when the fd is closed or the process dies; lock files are never unlinked.
+// A shared lock excludes only exclusive holders and leaves the file alone.
+static int lock_acquire(const std::string &path, int timeout_sec, FileLock *lock, double *waited, bool shared = false) {
+    double start = monotonic_seconds();
+    if (waited) *waited = 0.0;
+    int fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct flock fl;
+    std::memset(&fl, 0, sizeof(fl));
+    fl.l_type = shared ? F_RDLCK : F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    for (;;) {
+        if (fcntl(fd, F_OFD_SETLK, &fl) == 0) break;
+        if (errno != EAGAIN && errno != EACCES && errno != EINTR) {
+            int saved = errno;
+            ::close(fd);
+            errno = saved;
             return -1;
         }
+        double elapsed = monotonic_seconds() - start;
+        if (timeout_sec >= 0 && elapsed >= static_cast<double>(timeout_sec)) {
+            ::close(fd);
+            if (waited) *waited = elapsed;
+            trace_event("lock wait", "lock", start, {{"path", path}, {"result", "busy"}});
+            return 0;
+        }
+        usleep(200000);
+    }
+    if (waited) *waited = monotonic_seconds() - start;
+    trace_event("lock wait", "lock", start, {{"path", path}, {"result", "acquired"}});
+    if (shared) {
+        lock->fd = fd;
+        lock->path = path;
+        return 1;
     }
-    return 0;
-}
 
-static void unlock_file_path(const std::string &path) {
-    FILE *f = std::fopen(path.c_str(), "r");
-    if (!f) return;
-    char buf[64] = {0};
-    if (std::fgets(buf, sizeof(buf), f)) {
-        pid_t pid = static_cast<pid_t>(std::atoi(buf));
-        if (pid > 0) {
-            char proc_path[128];
-            std::snprintf(proc_path, sizeof(proc_path), "/proc/%d", pid);
-            if (pid == getpid() && access(proc_path, F_OK) == 0) {
-                unlink(path.c_str());
-            }
-        }
+    char buf[32];
+    int len = std::snprintf(buf, sizeof(buf), "%d\n", static_cast<int>(getpid()));
+    if (ftruncate(fd, 0) != 0 || len <= 0 || ::pwrite(fd, buf, static_cast<size_t>(len), 0) != len) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
     }
-    std::fclose(f);
+    lock->fd = fd;
+    lock->path = path;
+    return 1;
+}
+
+static void lock_release(FileLock *lock) {
+    if (lock->fd < 0) return;
+    ::close(lock->fd);
+    lock->fd = -1;
+}
+
+// Turns a held shared lock exclusive without waiting; false while another
+// process shares it. Without a lock (dry runs) there is nobody to wait for.
+static bool lock_try_exclusive(FileLock *lock) {
+    if (lock->fd < 0) return true;
+    struct flock fl;
+    std::memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    return fcntl(lock->fd, F_OFD_SETLK, &fl) == 0;
 }
 
-static int lock_file() {
-    return lock_file_path(LOCK_FILE);
+static int lock_file(int timeout_sec, double *waited) {
+    return lock_acquire(LOCK_FILE, timeout_sec, &global_lock, waited);
 }
 
 static void unlock_file() {
-    unlock_file_path(LOCK_FILE);
+    lock_release(&global_lock);
 }
 
-static RunPolicy parse_run_policy(const std::string &value, bool *ok) {
-    std::string v = value;
-    for (auto &c : v) c = static_cast<char>(std::tolower(c));
-    if (v.empty() || v == "auto") {
-        *ok = true;
-        return RunPolicy::Auto;
+static std::string escape_lock_name(const std::string &value) {
+    std::string out;
+    size_t start = 0;
+    while (start < value.size() && value[start] == '/') start++;
+    size_t end = value.size();
+    while (end > start && value[end - 1] == '/') end--;
+    for (size_t i = start; i < end; i++) {
+        unsigned char c = static_cast<unsigned char>(value[i]);
+        if (c == '/') {
+            out.push_back('-');
+        } else if (std::isalnum(c) || c == '_' || c == '.') {
+            out.push_back(static_cast<char>(c));
+        } else {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\x%02x", c);
+            out += buf;
+        }
     }
-    if (v == "demand") {
-        *ok = true;
-        return RunPolicy::Demand;
+    return out.empty() ? "-" : out;
+}
+
+static std::string job_lock_path(const std::string &name) {
+    return std::string(LOCK_DIR) + "/timevault." + name + ".pid";
+}
+
+static std::string mount_lock_path(const std::string &mount) {
+    return std::string(LOCK_DIR) + "/timevault.mount." + escape_lock_name(mount) + ".lock";
+}
+
+static bool source_device_id(const std::string &source, std::string *id) {
+    if (source.empty() || source[0] != '/') return false;
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0) return false;
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%u-%u", major(st.st_dev), minor(st.st_dev));
+    *id = buf;
+    return true;
+}
+
+static bool source_host(const std::string &source, std::string *host) {
+    std::string rest;
+    if (source.rfind("rsync://", 0) == 0) {
+        rest = source.substr(8);
+        rest = rest.substr(0, rest.find('/'));
+        rest = rest.substr(0, rest.find(':'));
+    } else {
+        size_t colon = source.find(':');
+        size_t slash = source.find('/');
+        if (colon == std::string::npos || (slash != std::string::npos && slash < colon)) return false;
+        rest = source.substr(0, colon);
     }
-    if (v == "off") {
-        *ok = true;
-        return RunPolicy::Off;
+    size_t at = rest.rfind('@');
+    if (at != std::string::npos) rest = rest.substr(at + 1);
+    if (rest.empty()) return false;
+    *host = rest;
+    return true;
+}
+
+static bool source_lock_path(const std::string &source, std::string *path) {
+    std::string id;
+    if (!source_device_id(source, &id)) return false;
+    *path = std::string(LOCK_DIR) + "/timevault.dev." + id + ".lock";
+    return true;
+}
+
+// Copies each job's final state, spans and child usage from the status
+// table into the metrics, along with run-level spans recorded since the run
+// (such as the final sync).
+static void collect_job_status(RunMetrics *metrics) {
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    for (auto &job : metrics->jobs) {
+        auto it = job_status.find(job.name);
+        if (it == job_status.end()) continue;
+        job.status = it->second.state;
+        job.phases = it->second.spans;
+        job.usage = it->second.usage;
     }
-    *ok = false;
-    return RunPolicy::Off;
+    metrics->phases = run_spans;
 }
 
-static bool path_has_parent_dir(const std::string &path) {
-    size_t i = 0;
-    while (i < path.size()) {
-        while (i < path.size() && path[i] == '/') i++;
-        if (i >= path.size()) break;
-        size_t start = i;
-        while (i < path.size() && path[i] != '/') i++;
-        size_t len = i - start;
-        if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
-            return true;
+static void print_phase_table(const RunMetrics &metrics) {
+    int width = 3;
+    for (const auto &job : metrics.jobs) {
+        width = std::max(width, static_cast<int>(job.name.size()));
+    }
+    std::printf("  phase timings:\n");
+    std::printf("    %-*s %-16s %10s %10s\n", width, "job", "phase", "start", "duration");
+    for (const auto &job : metrics.jobs) {
+        for (const auto &span : job.phases) {
+            std::printf("    %-*s %-16s %+9.3fs %9.3fs\n", width, job.name.c_str(), span.name.c_str(),
+                span.start_sec - metrics.started, span.duration_sec);
         }
     }
-    return false;
+    for (const auto &span : metrics.phases) {
+        std::printf("    %-*s %-16s %+9.3fs %9.3fs\n", width, "-", span.name.c_str(),
+            span.start_sec - metrics.started, span.duration_sec);
+    }
 }
 
-static bool path_starts_with(const std::string &path, const std::string &prefix) {
-    if (prefix.empty()) return false;
-    size_t prefix_len = prefix.size();
-    while (prefix_len > 1 && prefix[prefix_len - 1] == '/') {
-        prefix_len--;
+static void print_run_metrics(const RunMetrics &metrics, const RunMode &mode) {
+    if (!mode.verbose && metrics.lock_wait_sec < 0.2 && metrics.workers <= 1) return;
+    std::printf("run metrics:\n");
+    std::printf("  lock wait: %.3fs\n", metrics.lock_wait_sec);
+    if (metrics.workers > 1 || mode.verbose) {
+        std::printf("  workers: %d (steals: %d)\n", metrics.workers, metrics.steals);
+        std::printf("  mount cycles: %d for %zu job(s)\n", metrics.mount_cycles, metrics.jobs.size());
+        std::printf("  mount transitions: %d in start order (dependency order: %d)\n",
+            metrics.mount_transitions, metrics.baseline_transitions);
+        std::printf("  limits: per_disk %d, per_source %d, per_host %d\n", metrics.limits.per_disk, metrics.limits.per_source, metrics.limits.per_host);
+        for (const auto &res : metrics.resources) {
+            std::printf("  resource %s: peak %d of %d\n", res.name.c_str(), res.peak, res.limit);
+        }
     }
-    if (prefix_len == 1 && prefix[0] == '/') {
-        return !path.empty() && path[0] == '/';
+    if (!mode.verbose) return;
+    for (const auto &job : metrics.jobs) {
+        std::printf("  job %s lock wait: %.3fs\n", job.name.c_str(), job.lock_wait_sec);
     }
-    if (path.size() < prefix_len) return false;
-    if (path.compare(0, prefix_len, prefix, 0, prefix_len) != 0) return false;
-    return path.size() == prefix_len || path[prefix_len] == '/';
+    print_phase_table(metrics);
 }
 
-static bool validate_job_paths_config(const Job &job, const std::string &mount_prefix, std::string *err) {
-    if (job.dest.empty()) {
-        *err = "destination path is empty";
-        return false;
+static std::string json_string(const std::string &value) {
+    std::string out = "\"";
+    for (char c : value) {
+        unsigned char u = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (u < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", u);
+            out += buf;
+        } else {
+            out += c;
+        }
     }
-    if (job.mount.empty()) {
+    return out + "\"";
+}
+
+static void json_phases(FILE *f, const std::vector<PhaseSpan> &phases, double run_started) {
+    std::fprintf(f, "[");
+    for (size_t i = 0; i < phases.size(); i++) {
+        std::fprintf(f, "%s{\"name\": %s, \"start_sec\": %.6f, \"duration_sec\": %.6f}", i ? ", " : "",
+            json_string(phases[i].name).c_str(), phases[i].start_sec - run_started, phases[i].duration_sec);
+    }
+    std::fprintf(f, "]");
+}
+
+// Chrome trace event format (chrome://tracing, Perfetto): complete events
+// with microsecond timestamps relative to the start of tracing.
+static bool trace_write(const std::string &path) {
+    std::lock_guard<std::mutex> guard(trace_mutex);
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    int pid = static_cast<int>(getpid());
+    std::fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    std::fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"timevault\"}}", pid);
+    for (const auto &thread : trace_threads) {
+        std::fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": %s}}",
+            pid, thread.first, json_string(thread.second).c_str());
+    }
+    for (const auto &ev : trace_events) {
+        std::fprintf(f, ",\n{\"name\": %s, \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {",
+            json_string(ev.name).c_str(), ev.category, (ev.start_sec - trace_started) * 1e6, ev.duration_sec * 1e6, pid, ev.tid);
+        for (size_t i = 0; i < ev.args.size(); i++) {
+            std::fprintf(f, "%s%s: %s", i ? ", " : "", json_string(ev.args[i].first).c_str(), json_string(ev.args[i].second).c_str());
+        }
+        std::fprintf(f, "}}");
+    }
+    std::fprintf(f, "\n]}\n");
+    bool ok = !std::ferror(f);
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// One document per run, replaced atomically so readers never see a partial
+// report. Counters that were not measured (rsync stats without --stats
+// output, jobs that never started) are null.
+static bool write_run_report(const std::string &path, const RunMetrics &metrics, int exit_code, const RunMode &mode) {
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    std::fprintf(f, "{\n");
+    std::fprintf(f, "  \"version\": %s,\n", json_string(TIMEVAULT_VERSION).c_str());
+    std::fprintf(f, "  \"started_at\": %lld,\n", metrics.started_at);
+    std::fprintf(f, "  \"finished_at\": %lld,\n", static_cast<long long>(std::time(nullptr)));
+    std::fprintf(f, "  \"duration_sec\": %.3f,\n", monotonic_seconds() - metrics.started);
+    std::fprintf(f, "  \"dry_run\": %s,\n", mode.dry_run ? "true" : "false");
+    std::fprintf(f, "  \"exit_code\": %d,\n", exit_code);
+    std::fprintf(f, "  \"lock_wait_sec\": %.3f,\n", metrics.lock_wait_sec);
+    std::fprintf(f, "  \"workers\": %d,\n", metrics.workers);
+    std::fprintf(f, "  \"mount_cycles\": %d,\n", metrics.mount_cycles);
+    std::fprintf(f, "  \"mount_transitions\": %d,\n", metrics.mount_transitions);
+    std::fprintf(f, "  \"phases\": ");
+    json_phases(f, metrics.phases, metrics.started);
+    std::fprintf(f, ",\n  \"jobs\": [");
+    for (size_t i = 0; i < metrics.jobs.size(); i++) {
+        const JobMetrics &job = metrics.jobs[i];
+        std::fprintf(f, "%s\n    {\n", i ? "," : "");
+        std::fprintf(f, "      \"name\": %s,\n", json_string(job.name).c_str());
+        std::fprintf(f, "      \"status\": %s,\n", json_string(job.status.empty() ? "pending" : job.status).c_str());
+        if (job.exit_code < 0) {
+            std::fprintf(f, "      \"exit_code\": null,\n");
+        } else {
+            std::fprintf(f, "      \"exit_code\": %d,\n", job.exit_code);
+        }
+        std::fprintf(f, "      \"rsync_exit_codes\": [");
+        for (size_t k = 0; k < job.rsync_codes.size(); k++) {
+            std::fprintf(f, "%s%d", k ? ", " : "", job.rsync_codes[k]);
+        }
+        std::fprintf(f, "],\n");
+        std::fprintf(f, "      \"duration_sec\": %.3f,\n", job.duration_sec);
+        std::fprintf(f, "      \"lock_wait_sec\": %.3f,\n", job.lock_wait_sec);
+        if (job.files_transferred < 0) {
+            std::fprintf(f, "      \"files_transferred\": null,\n");
+        } else {
+            std::fprintf(f, "      \"files_transferred\": %lld,\n", job.files_transferred);
+        }
+        if (job.bytes_transferred < 0) {
+            std::fprintf(f, "      \"bytes_transferred\": null,\n");
+        } else {
+            std::fprintf(f, "      \"bytes_transferred\": %lld,\n", job.bytes_transferred);
+        }
+        std::fprintf(f, "      \"snapshots_expired\": %d,\n", job.snapshots_expired);
+        std::fprintf(f, "      \"bytes_reclaimed\": %lld,\n", job.bytes_reclaimed);
+        std::fprintf(f, "      \"phases\": ");
+        json_phases(f, job.phases, metrics.started);
+        const ChildUsage &u = job.usage;
+        std::fprintf(f, ",\n      \"rusage\": {\"processes\": %d, \"user_sec\": %.3f, \"sys_sec\": %.3f, \"max_rss_kb\": %ld, "
+            "\"block_in\": %ld, \"block_out\": %ld, \"voluntary_switches\": %ld, \"involuntary_switches\": %ld}\n",
+            u.processes, u.user_sec, u.sys_sec, u.max_rss_kb, u.block_in, u.block_out, u.voluntary_switches, u.involuntary_switches);
+        std::fprintf(f, "    }");
+    }
+    std::fprintf(f, "%s]\n}\n", metrics.jobs.empty() ? "" : "\n  ");
+    bool ok = !std::ferror(f);
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+struct PromMetric {
+    const char *name;
+    const char *type;
+    const char *help;
+};
+
+static const PromMetric PROM_METRICS[] = {
+    {"timevault_disk_free_bytes", "gauge", "Free bytes on the backup disk after the last job that used it."},
+    {"timevault_disk_unique_bytes", "gauge", "Sum over the disk's jobs of bytes held by only one snapshot."},
+    {"timevault_disk_used_bytes", "gauge", "Bytes in use on the backup disk; hard-linked snapshot files are counted once."},
+    {"timevault_job_bytes_transferred", "gauge", "Bytes rsync transferred in the last run."},
+    {"timevault_job_duration_seconds", "gauge", "Duration of the last run."},
+    {"timevault_job_files_transferred", "gauge", "Files rsync transferred in the last run."},
+    {"timevault_job_last_exit_code", "gauge", "Exit code of the last run (0 ok, 1 failed, 2 lock error, 3 already running)."},
+    {"timevault_job_last_run_timestamp_seconds", "gauge", "Unix time the last run finished."},
+    {"timevault_job_last_success_timestamp_seconds", "gauge", "Unix time the last successful run finished."},
+    {"timevault_job_lock_wait_seconds_total", "counter", "Time spent waiting for job, mount and source locks."},
+    {"timevault_job_phase_duration_seconds", "gauge", "Duration of each phase of the last run."},
+    {"timevault_job_rsync_retries_total", "counter", "rsync passes that followed a failed pass."},
+    {"timevault_job_runs_total", "counter", "Runs by result."},
+    {"timevault_job_snapshots", "gauge", "Snapshots kept for the job after the last run."},
+    {"timevault_job_unique_bytes", "gauge", "Bytes held by only one of the job's snapshots."},
+    {"timevault_snapshot_unique_bytes", "gauge", "Bytes only this snapshot holds, freed when it expires."},
+};
+
+// Samples keyed by "name{labels}". Loaded from the existing file on first
+// use so counters and the gauges of jobs not run by this process carry over.
+static std::mutex prom_mutex;
+static std::map<std::string, double> prom_samples;
+static bool prom_loaded = false;
+
+static std::string prom_label(const std::string &value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+static void prom_load(const std::string &path) {
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (!f) return;
+    char line[1024];
+    while (std::fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        char *space = std::strrchr(line, ' ');
+        if (!space) continue;
+        *space = '\0';
+        prom_samples[line] = std::strtod(space + 1, nullptr);
+    }
+    std::fclose(f);
+}
+
+static bool prom_write(const std::string &path) {
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    std::string current;
+    for (const auto &sample : prom_samples) {
+        std::string name = sample.first.substr(0, sample.first.find('{'));
+        if (name != current) {
+            current = name;
+            for (const auto &metric : PROM_METRICS) {
+                if (name != metric.name) continue;
+                std::fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metric.name, metric.help, metric.name, metric.type);
+            }
+        }
+        std::fprintf(f, "%s %.15g\n", sample.first.c_str(), sample.second);
+    }
+    bool ok = !std::ferror(f);
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Called after each job so node_exporter's textfile collector sees progress
+// during long runs; the file is replaced atomically.
+static void export_job_metrics(const std::string &path, const Job &job, const JobMetrics &m, const char *result) {
+    std::vector<PhaseSpan> spans;
+    {
+        std::lock_guard<std::mutex> guard(job_status_mutex);
+        auto it = job_status.find(job.name);
+        if (it != job_status.end()) spans = it->second.spans;
+    }
+    std::lock_guard<std::mutex> guard(prom_mutex);
+    if (!prom_loaded) {
+        prom_load(path);
+        prom_loaded = true;
+    }
+    std::string job_label = "{job=\"" + prom_label(job.name) + "\"}";
+    double now = static_cast<double>(std::time(nullptr));
+    prom_samples["timevault_job_runs_total{job=\"" + prom_label(job.name) + "\",result=\"" + result + "\"}"] += 1;
+    prom_samples["timevault_job_last_run_timestamp_seconds" + job_label] = now;
+    prom_samples["timevault_job_lock_wait_seconds_total" + job_label] += m.lock_wait_sec;
+    if (m.exit_code >= 0) {
+        prom_samples["timevault_job_last_exit_code" + job_label] = m.exit_code;
+        prom_samples["timevault_job_duration_seconds" + job_label] = m.duration_sec;
+    }
+    if (m.exit_code == 0) {
+        prom_samples["timevault_job_last_success_timestamp_seconds" + job_label] = now;
+    }
+    int retries = 0;
+    for (size_t i = 1; i < m.rsync_codes.size(); i++) {
+        if (m.rsync_codes[i - 1] != 0) retries++;
+    }
+    prom_samples["timevault_job_rsync_retries_total" + job_label] += retries;
+    if (m.bytes_transferred >= 0) prom_samples["timevault_job_bytes_transferred" + job_label] = static_cast<double>(m.bytes_transferred);
+    if (m.files_transferred >= 0) prom_samples["timevault_job_files_transferred" + job_label] = static_cast<double>(m.files_transferred);
+    if (m.snapshots >= 0) prom_samples["timevault_job_snapshots" + job_label] = m.snapshots;
+    if (!spans.empty()) {
+        std::string prefix = "timevault_job_phase_duration_seconds{job=\"" + prom_label(job.name) + "\",";
+        auto it = prom_samples.lower_bound(prefix);
+        while (it != prom_samples.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = prom_samples.erase(it);
+        }
+        for (const auto &span : spans) {
+            prom_samples[prefix + "phase=\"" + prom_label(span.name) + "\"}"] += span.duration_sec;
+        }
+    }
+    std::string mount_label = "{mount=\"" + prom_label(job.mount) + "\"}";
+    if (!m.snapshot_unique_bytes.empty()) {
+        // Replaced as a whole so expired snapshots drop out.
+        std::string labels = "{job=\"" + prom_label(job.name) + "\",mount=\"" + prom_label(job.mount) + "\"";
+        std::string prefix = "timevault_snapshot_unique_bytes" + labels + ",";
+        auto it = prom_samples.lower_bound(prefix);
+        while (it != prom_samples.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = prom_samples.erase(it);
+        }
+        long long job_unique = 0;
+        for (const auto &snap : m.snapshot_unique_bytes) {
+            prom_samples[prefix + "snapshot=\"" + prom_label(snap.first) + "\"}"] = static_cast<double>(snap.second);
+            job_unique += snap.second;
+        }
+        prom_samples["timevault_job_unique_bytes" + labels + "}"] = static_cast<double>(job_unique);
+        std::string job_prefix = "timevault_job_unique_bytes{";
+        std::string mount_suffix = ",mount=\"" + prom_label(job.mount) + "\"}";
+        double disk_unique = 0.0;
+        for (it = prom_samples.lower_bound(job_prefix); it != prom_samples.end() && it->first.compare(0, job_prefix.size(), job_prefix) == 0; ++it) {
+            if (it->first.size() >= mount_suffix.size() &&
+                it->first.compare(it->first.size() - mount_suffix.size(), mount_suffix.size(), mount_suffix) == 0) {
+                disk_unique += it->second;
+            }
+        }
+        prom_samples["timevault_disk_unique_bytes" + mount_label] = disk_unique;
+    }
+    if (m.disk_used_bytes >= 0) prom_samples["timevault_disk_used_bytes" + mount_label] = static_cast<double>(m.disk_used_bytes);
+    if (m.disk_free_bytes >= 0) prom_samples["timevault_disk_free_bytes" + mount_label] = static_cast<double>(m.disk_free_bytes);
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    if (!prom_write(path)) {
+        std::printf("cannot write metrics %s: %s\n", path.c_str(), std::strerror(errno));
+    }
+}
+
+struct RunOutputs {
+    std::string report_json;
+    std::string trace;
+};
+
+// Writes the per-run files requested on the command line. Trace events are
+// cleared afterwards so in daemon mode each trace covers one run.
+static void write_run_outputs(const RunOutputs &outputs, const RunMetrics &metrics, int exit_code, const RunMode &mode) {
+    if (!outputs.report_json.empty() && !write_run_report(outputs.report_json, metrics, exit_code, mode)) {
+        std::printf("cannot write report %s: %s\n", outputs.report_json.c_str(), std::strerror(errno));
+    }
+    if (!outputs.trace.empty()) {
+        if (!trace_write(outputs.trace)) {
+            std::printf("cannot write trace %s: %s\n", outputs.trace.c_str(), std::strerror(errno));
+        }
+        std::lock_guard<std::mutex> guard(trace_mutex);
+        trace_events.clear();
+    }
+}
+
+static RunPolicy parse_run_policy(const std::string &value, bool *ok) {
+    std::string v = value;
+    for (auto &c : v) c = static_cast<char>(std::tolower(c));
+    if (v.empty() || v == "auto") {
+        *ok = true;
+        return RunPolicy::Auto;
+    }
+    if (v == "demand") {
+        *ok = true;
+        return RunPolicy::Demand;
+    }
+    if (v == "off") {
+        *ok = true;
+        return RunPolicy::Off;
+    }
+    *ok = false;
+    return RunPolicy::Off;
+}
+
+struct CronSpec {
+    uint64_t minutes = 0;
+    uint64_t hours = 0;
+    uint64_t days = 0;
+    uint64_t months = 0;
+    uint64_t weekdays = 0;
+    bool any_day = true;
+    bool any_weekday = true;
+};
+
+static bool parse_cron_number(const std::string &text, int lo, int hi, int *value) {
+    if (text.empty() || text.size() > 2) return false;
+    int v = 0;
+    for (char c : text) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) return false;
+        v = v * 10 + (c - '0');
+    }
+    if (v < lo || v > hi) return false;
+    *value = v;
+    return true;
+}
+
+static bool parse_cron_field(const std::string &field, int lo, int hi, uint64_t *bits) {
+    size_t start = 0;
+    while (start <= field.size()) {
+        size_t comma = field.find(',', start);
+        if (comma == std::string::npos) comma = field.size();
+        std::string item = field.substr(start, comma - start);
+        int step = 1;
+        size_t slash = item.find('/');
+        if (slash != std::string::npos) {
+            if (!parse_cron_number(item.substr(slash + 1), 1, hi, &step)) return false;
+            item.resize(slash);
+        }
+        int first = lo;
+        int last = hi;
+        if (item != "*") {
+            size_t dash = item.find('-');
+            if (!parse_cron_number(item.substr(0, dash), lo, hi, &first)) return false;
+            last = first;
+            if (dash != std::string::npos) {
+                if (!parse_cron_number(item.substr(dash + 1), lo, hi, &last) || last < first) return false;
+            } else if (slash != std::string::npos) {
+                last = hi;
+            }
+        }
+        for (int v = first; v <= last; v += step) {
+            *bits |= 1ULL << v;
+        }
+        start = comma + 1;
+    }
+    return *bits != 0;
+}
+
+// Five-field crontab syntax (minute hour day-of-month month day-of-week) with
+// lists, ranges and steps, plus the @hourly/@daily/@weekly/@monthly macros.
+// As in cron, a job is due when either day field matches if both are set.
+static bool parse_cron(const std::string &text, CronSpec *spec) {
+    std::string expr = text;
+    if (expr == "@hourly") {
+        expr = "0 * * * *";
+    } else if (expr == "@daily" || expr == "@midnight") {
+        expr = "0 0 * * *";
+    } else if (expr == "@weekly") {
+        expr = "0 0 * * 0";
+    } else if (expr == "@monthly") {
+        expr = "0 0 1 * *";
+    } else if (expr == "@yearly" || expr == "@annually") {
+        expr = "0 0 1 1 *";
+    }
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    while (pos < expr.size()) {
+        size_t end = expr.find_first_of(" \t", pos);
+        if (end == std::string::npos) end = expr.size();
+        if (end > pos) fields.push_back(expr.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    if (fields.size() != 5) return false;
+    CronSpec parsed;
+    if (!parse_cron_field(fields[0], 0, 59, &parsed.minutes) ||
+        !parse_cron_field(fields[1], 0, 23, &parsed.hours) ||
+        !parse_cron_field(fields[2], 1, 31, &parsed.days) ||
+        !parse_cron_field(fields[3], 1, 12, &parsed.months) ||
+        !parse_cron_field(fields[4], 0, 7, &parsed.weekdays)) {
+        return false;
+    }
+    if (parsed.weekdays & (1ULL << 7)) parsed.weekdays |= 1;
+    parsed.any_day = fields[2][0] == '*';
+    parsed.any_weekday = fields[4][0] == '*';
+    *spec = parsed;
+    return true;
+}
+
+static bool cron_matches(const CronSpec &spec, const struct tm &tm) {
+    if (!(spec.minutes & (1ULL << tm.tm_min)) || !(spec.hours & (1ULL << tm.tm_hour)) ||
+        !(spec.months & (1ULL << (tm.tm_mon + 1)))) {
+        return false;
+    }
+    bool day = (spec.days & (1ULL << tm.tm_mday)) != 0;
+    bool weekday = (spec.weekdays & (1ULL << tm.tm_wday)) != 0;
+    if (spec.any_day && spec.any_weekday) return true;
+    if (spec.any_day) return weekday;
+    if (spec.any_weekday) return day;
+    return day || weekday;
+}
+
+static bool path_has_parent_dir(const std::string &path) {
+    size_t i = 0;
+    while (i < path.size()) {
+        while (i < path.size() && path[i] == '/') i++;
+        if (i >= path.size()) break;
+        size_t start = i;
+        while (i < path.size() && path[i] != '/') i++;
+        size_t len = i - start;
+        if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool path_starts_with(const std::string &path, const std::string &prefix) {
+    if (prefix.empty()) return false;
+    size_t prefix_len = prefix.size();
+    while (prefix_len > 1 && prefix[prefix_len - 1] == '/') {
+        prefix_len--;
+    }
+    if (prefix_len == 1 && prefix[0] == '/') {
+        return !path.empty() && path[0] == '/';
+    }
+    if (path.size() < prefix_len) return false;
+    if (path.compare(0, prefix_len, prefix, 0, prefix_len) != 0) return false;
+    return path.size() == prefix_len || path[prefix_len] == '/';
+}
+
+static bool validate_job_paths_config(const Job &job, const std::string &mount_prefix, std::string *err) {
+    if (job.dest.empty()) {
+        *err = "destination path is empty";
+        return false;
+    }
+    if (job.mount.empty()) {
         *err = "mount is required for all jobs";
         return false;
     }
@@ -347,17 +1581,51 @@ static bool validate_job_paths_config(const Job &job, const std::string &mount_p
     return true;
 }
 
-static bool parse_config(const std::string &path, Config *cfg, std::string *err) {
+static bool parse_config_node(const YAML::Node &root, Config *cfg, std::string *err) {
     try {
-        YAML::Node root = YAML::LoadFile(path);
         if (root["mount_prefix"]) {
             cfg->mount_prefix = root["mount_prefix"].as<std::string>();
         }
+        if (root["lock_source_device"]) {
+            cfg->lock_source_device = root["lock_source_device"].as<bool>();
+        }
+        if (root["manifests"]) {
+            cfg->manifests = root["manifests"].as<bool>();
+        }
+        if (root["manifest_hashes"]) {
+            cfg->manifest_hashes = root["manifest_hashes"].as<bool>();
+        }
+        if (root["runtime_dir"]) {
+            cfg->runtime_dir = root["runtime_dir"].as<std::string>();
+        }
+        if (root["prometheus_textfile"]) {
+            cfg->prometheus_textfile = root["prometheus_textfile"].as<std::string>();
+        }
+        if (root["history"]) {
+            cfg->history_path = root["history"].as<std::string>();
+        }
+        if (root["concurrency"]) {
+            const YAML::Node &node = root["concurrency"];
+            ConcurrencyLimits &limits = cfg->limits;
+            limits.jobs = node["jobs"].as<int>(limits.jobs);
+            limits.per_disk = node["per_disk"].as<int>(limits.per_disk);
+            limits.per_source = node["per_source"].as<int>(limits.per_source);
+            limits.per_host = node["per_host"].as<int>(limits.per_host);
+            if (limits.jobs < 1 || limits.per_disk < 0 || limits.per_source < 0 || limits.per_host < 0) {
+                *err = "concurrency: jobs must be at least 1 and per-resource limits non-negative (0 = unlimited)";
+                return false;
+            }
+        }
         if (root["excludes"]) {
             for (const auto &ex : root["excludes"]) {
                 cfg->excludes.push_back(ex.as<std::string>());
             }
         }
+        cfg->exclude_sets.assign(1, cfg->excludes);
+        std::unordered_map<std::string, int> set_index;
+        std::string key;
+        for (const auto &ex : cfg->excludes) key += ex + '\n';
+        set_index.emplace(key, 0);
         if (!root["jobs"] || !root["jobs"].IsSequence()) {
             *err = "missing jobs";
             return false;
@@ -376,10 +1644,23 @@ static bool parse_config(const std::string &path, Config *cfg, std::string *err)
                 *err = "job " + job.name + ": invalid run policy " + run;
                 return false;
             }
-            job.excludes = cfg->excludes;
-            if (node["excludes"]) {
+            if (node["excludes"] && node["excludes"].size() > 0) {
+                std::vector<std::string> excludes = cfg->excludes;
                 for (const auto &ex : node["excludes"]) {
-                    job.excludes.push_back(ex.as<std::string>());
+                    excludes.push_back(ex.as<std::string>());
+                }
+                key.clear();
+                for (const auto &ex : excludes) key += ex + '\n';
+                auto inserted = set_index.emplace(key, static_cast<int>(cfg->exclude_sets.size()));
+                if (inserted.second) cfg->exclude_sets.push_back(std::move(excludes));
+                job.exclude_set = inserted.first->second;
+            }
+            if (node["schedule"]) {
+                job.schedule = node["schedule"].as<std::string>();
+                CronSpec spec;
+                if (!parse_cron(job.schedule, &spec)) {
+                    *err = "job " + job.name + ": invalid schedule " + job.schedule;
+                    return false;
                 }
             }
             if (node["depends_on"]) {
@@ -400,8 +1681,18 @@ static bool parse_config(const std::string &path, Config *cfg, std::string *err)
     }
 }
 
+static bool parse_config(const std::string &path, Config *cfg, std::string *err) {
+    try {
+        return parse_config_node(YAML::LoadFile(path), cfg, err);
+    } catch (const std::exception &e) {
+        *err = e.what();
+        return false;
+    }
+}
+
 static bool mount_in_fstab(const std::string &mount) {
-    FILE *f = std::fopen("/etc/fstab", "r");
+    if (executor.mode == ExecutorMode::Replay) return executor.fstab.count(mount) > 0;
+    FILE *f = std::fopen(FSTAB_PATH, "r");
     if (!f) return false;
     char line[1024];
     while (std::fgets(line, sizeof(line), f)) {
@@ -426,7 +1717,9 @@ static bool mount_in_fstab(const std::string &mount) {
 }
 
 static bool mount_is_mounted(const std::string &mount) {
-    FILE *f = std::fopen("/proc/mounts", "r");
+    int replayed = executor_mount_state(mount, false);
+    if (replayed != -2) return replayed == 1;
+    FILE *f = std::fopen(MOUNTS_PATH, "r");
     if (!f) return false;
     char line[1024];
     while (std::fgets(line, sizeof(line), f)) {
@@ -450,7 +1743,9 @@ static bool mount_is_mounted(const std::string &mount) {
 }
 
 static int mount_is_readonly(const std::string &mount) {
-    FILE *f = std::fopen("/proc/mounts", "r");
+    int replayed = executor_mount_state(mount, true);
+    if (replayed != -2) return replayed;
+    FILE *f = std::fopen(MOUNTS_PATH, "r");
     char line[1024];
     if (!f) return -1;
     while (std::fgets(line, sizeof(line), f)) {
@@ -511,11 +1806,18 @@ static bool ensure_unmounted(const std::string &mount, const RunMode &mode, std:
     return true;
 }
 
+// Bytes freed by remove_dir_recursive on this thread: directories and the
+// last link of each file.
+static thread_local long long removed_bytes = 0;
+
 static int remove_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    (void)sb;
     (void)typeflag;
     (void)ftwbuf;
-    return remove(fpath);
+    int rc = remove(fpath);
+    if (rc == 0 && (S_ISDIR(sb->st_mode) || sb->st_nlink == 1)) {
+        removed_bytes += static_cast<long long>(sb->st_blocks) * 512;
+    }
+    return rc;
 }
 
 static int remove_symlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
@@ -533,87 +1835,744 @@ static int delete_symlinks(const std::string &path) {
     return nftw(path.c_str(), remove_symlink_cb, 64, FTW_PHYS);
 }
 
-static int expire_old_backups(const Job &job, const std::string &dest, const RunMode &mode) {
-    DIR *d = opendir(dest.c_str());
-    if (!d) return 0;
-    std::vector<std::string> backups;
-    struct dirent *e;
-    while ((e = readdir(d)) != nullptr) {
-        if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0 || std::strcmp(e->d_name, "current") == 0 || std::strcmp(e->d_name, TIMEVAULT_MARKER) == 0) {
-            continue;
-        }
-        backups.emplace_back(e->d_name);
+// Snapshot manifests: <dest>/.manifests/<day>.tvm lists every entry of a
+// snapshot sorted by path. Entries are packed into blocks of
+// MANIFEST_RESTART_INTERVAL, each zlib-compressed and front-coded against
+// the previous path, with the first path in full as a restart point. The
+// uncompressed block index at the end (offsets plus first paths) is read
+// straight from the mapping, so a lookup inflates a single block.
+static const char MANIFEST_MAGIC[8] = {'T', 'V', 'M', 'A', 'N', 'I', 'F', '1'};
+static const uint32_t MANIFEST_VERSION = 1;
+static const uint32_t MANIFEST_HASHES = 1;
+static const uint32_t MANIFEST_RESTART_INTERVAL = 128;
+
+struct ManifestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t entry_count;
+    uint64_t index_offset;
+    uint64_t keys_offset;
+    uint64_t total_size;
+    uint32_t block_count;
+    uint32_t restart_interval;
+    int64_t created;
+};
+
+struct ManifestBlock {
+    uint64_t offset;
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    uint64_t key_offset;
+    uint32_t key_size;
+    uint32_t entry_count;
+};
+
+struct ManifestEntry {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint32_t mode = 0;
+    uint64_t inode = 0;
+    uint32_t crc = 0;
+};
+
+struct ManifestView {
+    const char *base = nullptr;
+    size_t size = 0;
+    ManifestHeader header;
+    const ManifestBlock *blocks = nullptr;
+};
+
+static std::string manifest_path(const std::string &dest, const std::string &snapshot) {
+    return dest + "/.manifests/" + snapshot + ".tvm";
+}
+
+static void put_varint(std::string *out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
     }
-    closedir(d);
-    if (backups.size() <= static_cast<size_t>(job.copies)) return 0;
-    std::sort(backups.begin(), backups.end());
-    size_t to_delete = backups.size() - static_cast<size_t>(job.copies);
-    for (size_t i = 0; i < to_delete; i++) {
-        std::string path = dest + "/" + backups[i];
-        struct stat st;
-        if (lstat(path.c_str(), &st) != 0) continue;
-        if (S_ISLNK(st.st_mode)) {
-            std::printf("skip symlink delete: %s\n", path.c_str());
-            continue;
-        }
-        if (S_ISDIR(st.st_mode)) {
-            if (mode.safe_mode || mode.dry_run) {
-                if (mode.dry_run) {
-                    std::printf("dry-run: rm -rf %s\n", path.c_str());
-                } else {
-                    std::printf("skip delete (safe-mode): %s\n", path.c_str());
-                }
-            } else {
-                std::printf("delete: %s\n", path.c_str());
-                remove_dir_recursive(path);
-            }
-        } else {
-            std::printf("skip non-dir delete: %s\n", path.c_str());
+    out->push_back(static_cast<char>(v));
+}
+
+static bool get_varint(const char **p, const char *end, uint64_t *v) {
+    uint64_t out = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char c = static_cast<unsigned char>(*(*p)++);
+        out |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = out;
+            return true;
         }
     }
-    return 0;
+    return false;
 }
 
-static bool create_excludes_file(const Job &job, const std::string &path) {
-    FILE *f = std::fopen(path.c_str(), "w");
-    if (!f) return false;
-    for (const auto &ex : job.excludes) {
-        std::fprintf(f, "%s\n", ex.c_str());
+static void manifest_encode(std::string *block, const std::string &prev, const ManifestEntry &e, bool hashes) {
+    size_t shared = 0;
+    size_t limit = std::min(prev.size(), e.path.size());
+    while (shared < limit && prev[shared] == e.path[shared]) shared++;
+    put_varint(block, shared);
+    put_varint(block, e.path.size() - shared);
+    block->append(e.path, shared, std::string::npos);
+    put_varint(block, e.size);
+    put_varint(block, (static_cast<uint64_t>(e.mtime_ns) << 1) ^ static_cast<uint64_t>(e.mtime_ns >> 63));
+    put_varint(block, e.mode);
+    put_varint(block, e.inode);
+    if (hashes) put_varint(block, e.crc);
+}
+
+static bool manifest_decode(const char **p, const char *end, bool hashes, ManifestEntry *e) {
+    uint64_t shared = 0, suffix = 0, mtime = 0, mode = 0, crc = 0;
+    if (!get_varint(p, end, &shared) || !get_varint(p, end, &suffix)) return false;
+    if (shared > e->path.size() || suffix > static_cast<uint64_t>(end - *p)) return false;
+    e->path.resize(shared);
+    e->path.append(*p, suffix);
+    *p += suffix;
+    if (!get_varint(p, end, &e->size) || !get_varint(p, end, &mtime) ||
+        !get_varint(p, end, &mode) || !get_varint(p, end, &e->inode)) {
+        return false;
     }
-    std::fclose(f);
+    if (hashes && !get_varint(p, end, &crc)) return false;
+    e->mtime_ns = static_cast<int64_t>(mtime >> 1) ^ -static_cast<int64_t>(mtime & 1);
+    e->mode = static_cast<uint32_t>(mode);
+    e->crc = static_cast<uint32_t>(crc);
     return true;
 }
 
-static bool verify_destination(const Job &job, const std::string &mount_prefix, std::string *err) {
-    if (job.dest.empty()) {
-        *err = "destination path is empty";
+static bool manifest_open(const std::string &path, ManifestView *view, std::string *err) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *err = "cannot open " + path + ": " + std::strerror(errno);
         return false;
     }
-    if (job.mount.empty()) {
-        *err = "mount is required for all jobs";
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ManifestHeader)) {
+        ::close(fd);
+        *err = path + " is truncated";
         return false;
     }
-    if (!mount_prefix.empty() && job.mount.rfind(mount_prefix, 0) != 0) {
-        *err = "mount " + job.mount + " does not start with required prefix " + mount_prefix;
+    size_t size = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        *err = "cannot map " + path + ": " + std::strerror(errno);
         return false;
     }
-    char dest_real[PATH_MAX];
-    char mount_real[PATH_MAX];
-    if (!realpath(job.dest.c_str(), dest_real)) {
-        *err = "cannot access destination " + job.dest + ": " + std::strerror(errno);
-        return false;
+    const char *base = static_cast<const char *>(map);
+    ManifestHeader h;
+    std::memcpy(&h, base, sizeof(h));
+    bool ok = std::memcmp(h.magic, MANIFEST_MAGIC, sizeof(h.magic)) == 0 &&
+        h.version == MANIFEST_VERSION &&
+        h.total_size == size &&
+        h.index_offset % alignof(ManifestBlock) == 0 &&
+        h.index_offset <= size &&
+        h.keys_offset == h.index_offset + static_cast<uint64_t>(h.block_count) * sizeof(ManifestBlock) &&
+        h.keys_offset <= size;
+    const ManifestBlock *blocks = reinterpret_cast<const ManifestBlock *>(base + h.index_offset);
+    for (uint32_t i = 0; ok && i < h.block_count; i++) {
+        const ManifestBlock &b = blocks[i];
+        ok = b.offset >= sizeof(ManifestHeader) && b.offset + b.compressed_size <= h.index_offset &&
+            b.key_offset >= h.keys_offset && b.key_offset + b.key_size <= size;
     }
-    if (std::strcmp(dest_real, "/") == 0) {
-        *err = "destination resolves to /";
+    if (!ok) {
+        munmap(map, size);
+        *err = path + " is not a valid manifest";
         return false;
     }
-    if (!realpath(job.mount.c_str(), mount_real)) {
-        *err = "cannot access mount " + job.mount + ": " + std::strerror(errno);
+    view->base = base;
+    view->size = size;
+    view->header = h;
+    view->blocks = blocks;
+    return true;
+}
+
+static void manifest_close(ManifestView *view) {
+    if (view->base) munmap(const_cast<char *>(view->base), view->size);
+    view->base = nullptr;
+}
+
+static bool manifest_read_block(const ManifestView &view, uint32_t block, std::vector<ManifestEntry> *out) {
+    const ManifestBlock &b = view.blocks[block];
+    std::string raw(b.raw_size, '\0');
+    uLongf raw_size = b.raw_size;
+    if (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &raw_size,
+            reinterpret_cast<const Bytef *>(view.base + b.offset), b.compressed_size) != Z_OK ||
+        raw_size != b.raw_size) {
         return false;
     }
-    if (std::strcmp(mount_real, "/") == 0) {
-        *err = "mount resolves to /";
-        return false;
+    bool hashes = (view.header.flags & MANIFEST_HASHES) != 0;
+    const char *p = raw.data();
+    const char *end = p + raw.size();
+    ManifestEntry e;
+    out->clear();
+    out->reserve(b.entry_count);
+    for (uint32_t i = 0; i < b.entry_count; i++) {
+        if (!manifest_decode(&p, end, hashes, &e)) return false;
+        out->push_back(e);
+    }
+    return p == end;
+}
+
+static std::string manifest_block_key(const ManifestView &view, uint32_t block) {
+    const ManifestBlock &b = view.blocks[block];
+    return std::string(view.base + b.key_offset, b.key_size);
+}
+
+// The block whose range covers key: binary search on block first paths.
+static uint32_t manifest_find_block(const ManifestView &view, const std::string &key) {
+    uint32_t lo = 0;
+    uint32_t hi = view.header.block_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (manifest_block_key(view, mid) <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? 0 : lo - 1;
+}
+
+static bool manifest_lookup(const ManifestView &view, const std::string &path, ManifestEntry *out) {
+    if (view.header.block_count == 0) return false;
+    std::vector<ManifestEntry> entries;
+    if (!manifest_read_block(view, manifest_find_block(view, path), &entries)) return false;
+    for (auto &e : entries) {
+        if (e.path == path) {
+            *out = std::move(e);
+            return true;
+        }
+    }
+    return false;
+}
+
+// nftw has no user pointer, so the walk collects into a thread_local.
+static thread_local std::vector<ManifestEntry> *manifest_walk_out = nullptr;
+static thread_local size_t manifest_walk_root = 0;
+
+static int manifest_walk_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)typeflag;
+    if (ftwbuf->level == 0) return 0;
+    ManifestEntry e;
+    e.path.assign(fpath + manifest_walk_root + 1);
+    e.size = static_cast<uint64_t>(sb->st_size);
+    e.mtime_ns = static_cast<int64_t>(sb->st_mtim.tv_sec) * 1000000000LL + sb->st_mtim.tv_nsec;
+    e.mode = sb->st_mode;
+    e.inode = sb->st_ino;
+    manifest_walk_out->push_back(std::move(e));
+    return 0;
+}
+
+// False with errno set when the file cannot be read to the end.
+static bool crc_file(const std::string &path, uint32_t *crc) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return false;
+    uLong value = crc32(0L, Z_NULL, 0);
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) value = crc32(value, reinterpret_cast<const Bytef *>(buf), static_cast<uInt>(n));
+    }
+    int saved = errno;
+    ::close(fd);
+    if (n < 0) {
+        errno = saved;
+        return false;
+    }
+    *crc = static_cast<uint32_t>(value);
+    return true;
+}
+
+// Hashes are only computed for files whose inode, size and mtime are not in
+// the previous snapshot's manifest; after cp -ral and rsync that is just
+// what changed. A file that cannot be hashed fails the manifest rather than
+// being recorded with a crc that would match other versions.
+static bool write_snapshot_manifest(
+    const std::string &dest,
+    const std::string &snapshot,
+    const std::string &previous,
+    bool hashes,
+    std::string *err
+) {
+    std::string root = dest + "/" + snapshot;
+    std::vector<ManifestEntry> entries;
+    manifest_walk_out = &entries;
+    manifest_walk_root = root.size();
+    int walk_rc = nftw(root.c_str(), manifest_walk_cb, 64, FTW_PHYS);
+    manifest_walk_out = nullptr;
+    if (walk_rc != 0) {
+        *err = "cannot walk " + root + ": " + std::strerror(errno);
+        return false;
+    }
+    std::sort(entries.begin(), entries.end(), [](const ManifestEntry &a, const ManifestEntry &b) {
+        return a.path < b.path;
+    });
+
+    if (hashes) {
+        std::unordered_map<uint64_t, const ManifestEntry *> known;
+        std::vector<ManifestEntry> prev_entries;
+        ManifestView prev;
+        std::string prev_err;
+        if (!previous.empty() && manifest_open(manifest_path(dest, previous), &prev, &prev_err)) {
+            if (prev.header.flags & MANIFEST_HASHES) {
+                std::vector<ManifestEntry> block;
+                for (uint32_t i = 0; i < prev.header.block_count && manifest_read_block(prev, i, &block); i++) {
+                    for (auto &e : block) {
+                        if (S_ISREG(e.mode)) prev_entries.push_back(std::move(e));
+                    }
+                }
+            }
+            manifest_close(&prev);
+        }
+        known.reserve(prev_entries.size());
+        for (const auto &e : prev_entries) known.emplace(e.inode, &e);
+        for (auto &e : entries) {
+            if (!S_ISREG(e.mode)) continue;
+            auto it = known.find(e.inode);
+            if (it != known.end() && it->second->size == e.size && it->second->mtime_ns == e.mtime_ns) {
+                e.crc = it->second->crc;
+            } else if (!crc_file(root + "/" + e.path, &e.crc)) {
+                *err = "cannot hash " + root + "/" + e.path + ": " + std::strerror(errno);
+                return false;
+            }
+        }
+    }
+
+    ManifestHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.flags = hashes ? MANIFEST_HASHES : 0;
+    header.entry_count = entries.size();
+    header.restart_interval = MANIFEST_RESTART_INTERVAL;
+    header.created = static_cast<int64_t>(std::time(nullptr));
+
+    std::string body;
+    std::string keys;
+    std::vector<ManifestBlock> blocks;
+    std::string raw;
+    std::string packed;
+    for (size_t first = 0; first < entries.size(); first += MANIFEST_RESTART_INTERVAL) {
+        size_t last = std::min(entries.size(), first + MANIFEST_RESTART_INTERVAL);
+        raw.clear();
+        std::string prev_path;
+        for (size_t i = first; i < last; i++) {
+            manifest_encode(&raw, prev_path, entries[i], hashes);
+            prev_path = entries[i].path;
+        }
+        uLongf packed_size = compressBound(raw.size());
+        packed.resize(packed_size);
+        if (compress2(reinterpret_cast<Bytef *>(&packed[0]), &packed_size,
+                reinterpret_cast<const Bytef *>(raw.data()), raw.size(), 6) != Z_OK) {
+            *err = "compress failed";
+            return false;
+        }
+        ManifestBlock b;
+        std::memset(&b, 0, sizeof(b));
+        b.offset = sizeof(ManifestHeader) + body.size();
+        b.compressed_size = static_cast<uint32_t>(packed_size);
+        b.raw_size = static_cast<uint32_t>(raw.size());
+        b.key_offset = keys.size();
+        b.key_size = static_cast<uint32_t>(entries[first].path.size());
+        b.entry_count = static_cast<uint32_t>(last - first);
+        body.append(packed.data(), packed_size);
+        keys += entries[first].path;
+        blocks.push_back(b);
+    }
+    while ((sizeof(ManifestHeader) + body.size()) % alignof(ManifestBlock) != 0) body.push_back('\0');
+    header.block_count = static_cast<uint32_t>(blocks.size());
+    header.index_offset = sizeof(ManifestHeader) + body.size();
+    header.keys_offset = header.index_offset + blocks.size() * sizeof(ManifestBlock);
+    header.total_size = header.keys_offset + keys.size();
+    for (auto &b : blocks) b.key_offset += header.keys_offset;
+
+    std::string dir = dest + "/.manifests";
+    mkdir(dir.c_str(), 0755);
+    std::string path = manifest_path(dest, snapshot);
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE *f = std::fopen(tmp.c_str(), "we");
+    if (!f) {
+        *err = "cannot create " + tmp + ": " + std::strerror(errno);
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+        std::fwrite(body.data(), 1, body.size(), f) == body.size() &&
+        (blocks.empty() || std::fwrite(blocks.data(), sizeof(ManifestBlock), blocks.size(), f) == blocks.size()) &&
+        std::fwrite(keys.data(), 1, keys.size(), f) == keys.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        *err = "cannot write " + path + ": " + std::strerror(errno);
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Per-snapshot space accounting, cached in <dest>/.manifests/catalog: one
+// line per snapshot with the neighbours it was computed against, its
+// regular file count, and total and unique bytes (inodes no other snapshot
+// of this destination links to). A line is stale once its neighbours
+// change, which is exactly when a snapshot next to it was added or expired.
+static const char *CATALOG_HEADER = "# timevault snapshot catalog v1";
+
+struct SnapshotUsage {
+    std::string name;
+    std::string prev;
+    std::string next;
+    uint64_t files = 0;
+    uint64_t total_bytes = 0;
+    uint64_t unique_bytes = 0;
+};
+
+static std::string catalog_path(const std::string &dest) {
+    return dest + "/.manifests/catalog";
+}
+
+static void load_snapshot_catalog(const std::string &dest, std::map<std::string, SnapshotUsage> *catalog) {
+    FILE *f = std::fopen(catalog_path(dest).c_str(), "r");
+    if (!f) return;
+    char line[1024];
+    bool header = false;
+    while (std::fgets(line, sizeof(line), f)) {
+        if (!header) {
+            header = std::strncmp(line, CATALOG_HEADER, std::strlen(CATALOG_HEADER)) == 0;
+            if (!header) break;
+            continue;
+        }
+        char name[256], prev[256], next[256];
+        unsigned long long files = 0, total = 0, unique = 0;
+        if (std::sscanf(line, "%255s %255s %255s %llu %llu %llu", name, prev, next, &files, &total, &unique) != 6) continue;
+        SnapshotUsage u;
+        u.name = name;
+        u.prev = std::strcmp(prev, "-") == 0 ? "" : prev;
+        u.next = std::strcmp(next, "-") == 0 ? "" : next;
+        u.files = files;
+        u.total_bytes = total;
+        u.unique_bytes = unique;
+        (*catalog)[u.name] = u;
+    }
+    std::fclose(f);
+}
+
+static bool write_snapshot_catalog(const std::string &dest, const std::vector<SnapshotUsage> &usage) {
+    std::string dir = dest + "/.manifests";
+    mkdir(dir.c_str(), 0755);
+    std::string path = catalog_path(dest);
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE *f = std::fopen(tmp.c_str(), "we");
+    if (!f) return false;
+    std::fprintf(f, "%s\n", CATALOG_HEADER);
+    for (const auto &u : usage) {
+        std::fprintf(f, "%s %s %s %llu %llu %llu\n", u.name.c_str(),
+            u.prev.empty() ? "-" : u.prev.c_str(), u.next.empty() ? "-" : u.next.c_str(),
+            static_cast<unsigned long long>(u.files), static_cast<unsigned long long>(u.total_bytes),
+            static_cast<unsigned long long>(u.unique_bytes));
+    }
+    bool ok = std::fclose(f) == 0;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool list_snapshots(const std::string &dest, std::vector<std::string> *backups) {
+    DIR *d = opendir(dest.c_str());
+    if (!d) return false;
+    struct dirent *e;
+    while ((e = readdir(d)) != nullptr) {
+        // Dot entries are ours (the marker, .manifests), never snapshots.
+        if (e->d_name[0] == '.' || std::strcmp(e->d_name, "current") == 0) {
+            continue;
+        }
+        backups->emplace_back(e->d_name);
+    }
+    closedir(d);
+    return true;
+}
+
+static int expire_old_backups(const Job &job, const std::string &dest, const RunMode &mode, JobMetrics *job_metrics) {
+    std::vector<std::string> backups;
+    if (!list_snapshots(dest, &backups)) return 0;
+    if (backups.size() <= static_cast<size_t>(job.copies)) return 0;
+    std::sort(backups.begin(), backups.end());
+    size_t to_delete = backups.size() - static_cast<size_t>(job.copies);
+    std::map<std::string, SnapshotUsage> catalog;
+    if (mode.dry_run) load_snapshot_catalog(dest, &catalog);
+    for (size_t i = 0; i < to_delete; i++) {
+        std::string path = dest + "/" + backups[i];
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        if (S_ISLNK(st.st_mode)) {
+            std::printf("skip symlink delete: %s\n", path.c_str());
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (mode.safe_mode || mode.dry_run) {
+                if (mode.dry_run) {
+                    auto it = catalog.find(backups[i]);
+                    if (it != catalog.end()) {
+                        std::printf("dry-run: rm -rf %s (%llu unique bytes)\n", path.c_str(), static_cast<unsigned long long>(it->second.unique_bytes));
+                    } else {
+                        std::printf("dry-run: rm -rf %s\n", path.c_str());
+                    }
+                } else {
+                    std::printf("skip delete (safe-mode): %s\n", path.c_str());
+                }
+            } else {
+                std::printf("delete: %s\n", path.c_str());
+                removed_bytes = 0;
+                remove_dir_recursive(path);
+                ::unlink(manifest_path(dest, backups[i]).c_str());
+                job_metrics->snapshots_expired++;
+                job_metrics->bytes_reclaimed += removed_bytes;
+            }
+        } else {
+            std::printf("skip non-dir delete: %s\n", path.c_str());
+        }
+    }
+    return 0;
+}
+
+// Inodes seen across a set of snapshots, sharded so snapshot workers can
+// insert concurrently. owner is the first snapshot seen linking the inode;
+// shared is set once a second one does.
+static const size_t INODE_SHARDS = 64;
+
+struct InodeRef {
+    uint32_t owner;
+    bool shared;
+    uint64_t bytes;
+};
+
+struct InodeSet {
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<uint64_t, InodeRef> refs;
+    };
+    Shard shards[INODE_SHARDS];
+};
+
+static size_t inode_shard(uint64_t inode) {
+    return static_cast<size_t>((inode * 0x9e3779b97f4a7c15ULL) >> 58) % INODE_SHARDS;
+}
+
+// Regular files of one snapshot: from its manifest when there is one,
+// otherwise by walking it.
+static bool snapshot_files(const std::string &dest, const std::string &snapshot, std::vector<ManifestEntry> *out) {
+    ManifestView view;
+    std::string err;
+    if (manifest_open(manifest_path(dest, snapshot), &view, &err)) {
+        std::vector<ManifestEntry> block;
+        bool ok = true;
+        for (uint32_t i = 0; ok && i < view.header.block_count; i++) {
+            ok = manifest_read_block(view, i, &block);
+            for (auto &e : block) {
+                if (S_ISREG(e.mode)) out->push_back(std::move(e));
+            }
+        }
+        manifest_close(&view);
+        if (ok) return true;
+        out->clear();
+    }
+    std::string root = dest + "/" + snapshot;
+    std::vector<ManifestEntry> all;
+    manifest_walk_out = &all;
+    manifest_walk_root = root.size();
+    int rc = nftw(root.c_str(), manifest_walk_cb, 64, FTW_PHYS);
+    manifest_walk_out = nullptr;
+    for (auto &e : all) {
+        if (S_ISREG(e.mode)) out->push_back(std::move(e));
+    }
+    return rc == 0;
+}
+
+// Fills usage for the snapshots flagged in target, counting sharing against
+// every snapshot in window (targets and their neighbours).
+static bool account_snapshots(
+    const std::string &dest,
+    const std::vector<std::string> &window,
+    const std::vector<char> &target,
+    std::vector<SnapshotUsage> *usage
+) {
+    InodeSet inodes;
+    usage->assign(window.size(), SnapshotUsage());
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&]() {
+        std::vector<ManifestEntry> files;
+        std::unordered_set<uint64_t> seen;
+        std::vector<std::vector<std::pair<uint64_t, uint64_t>>> by_shard(INODE_SHARDS);
+        for (size_t idx = next++; idx < window.size(); idx = next++) {
+            files.clear();
+            seen.clear();
+            if (!snapshot_files(dest, window[idx], &files)) ok = false;
+            SnapshotUsage &u = (*usage)[idx];
+            u.name = window[idx];
+            for (const auto &e : files) {
+                if (!seen.insert(e.inode).second) continue;
+                u.files++;
+                u.total_bytes += e.size;
+                by_shard[inode_shard(e.inode)].emplace_back(e.inode, e.size);
+            }
+            uint32_t owner = static_cast<uint32_t>(idx);
+            for (size_t sh = 0; sh < INODE_SHARDS; sh++) {
+                if (by_shard[sh].empty()) continue;
+                InodeSet::Shard &shard = inodes.shards[sh];
+                std::lock_guard<std::mutex> guard(shard.mu);
+                for (const auto &ref : by_shard[sh]) {
+                    auto ins = shard.refs.emplace(ref.first, InodeRef{owner, false, ref.second});
+                    if (!ins.second && ins.first->second.owner != owner) ins.first->second.shared = true;
+                }
+                by_shard[sh].clear();
+            }
+        }
+    };
+    size_t threads = std::min<size_t>(window.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+    for (auto &shard : inodes.shards) {
+        for (const auto &entry : shard.refs) {
+            const InodeRef &ref = entry.second;
+            if (!ref.shared && target[ref.owner]) (*usage)[ref.owner].unique_bytes += ref.bytes;
+        }
+    }
+    return ok;
+}
+
+// Brings the catalog up to date and returns it in snapshot order. Only
+// stale or missing snapshots are recounted, against their neighbours: an
+// inode enters a snapshot and is carried forward by cp -ral until it
+// changes, so the snapshots linking it are always consecutive.
+static bool update_snapshot_catalog(const std::string &dest, bool full, std::vector<SnapshotUsage> *out, std::string *err) {
+    std::vector<std::string> snapshots;
+    if (!list_snapshots(dest, &snapshots)) {
+        *err = "cannot list " + dest + ": " + std::strerror(errno);
+        return false;
+    }
+    std::sort(snapshots.begin(), snapshots.end());
+    std::map<std::string, SnapshotUsage> catalog;
+    if (!full) load_snapshot_catalog(dest, &catalog);
+    size_t n = snapshots.size();
+    std::vector<char> stale(n, 0);
+    std::vector<char> in_window(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        std::string prev = i > 0 ? snapshots[i - 1] : "";
+        std::string next = i + 1 < n ? snapshots[i + 1] : "";
+        auto it = catalog.find(snapshots[i]);
+        if (it == catalog.end() || it->second.prev != prev || it->second.next != next) {
+            stale[i] = 1;
+            for (size_t j = i > 0 ? i - 1 : 0; j <= i + 1 && j < n; j++) in_window[j] = 1;
+        }
+    }
+    std::vector<std::string> window;
+    std::vector<char> target;
+    std::vector<size_t> window_index;
+    for (size_t i = 0; i < n; i++) {
+        if (!in_window[i]) continue;
+        window.push_back(snapshots[i]);
+        target.push_back(stale[i]);
+        window_index.push_back(i);
+    }
+    std::vector<SnapshotUsage> counted;
+    bool ok = window.empty() || account_snapshots(dest, window, target, &counted);
+    std::vector<SnapshotUsage> result(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!stale[i]) result[i] = catalog[snapshots[i]];
+    }
+    for (size_t w = 0; w < window.size(); w++) {
+        if (target[w]) result[window_index[w]] = counted[w];
+    }
+    for (size_t i = 0; i < n; i++) {
+        result[i].name = snapshots[i];
+        result[i].prev = i > 0 ? snapshots[i - 1] : "";
+        result[i].next = i + 1 < n ? snapshots[i + 1] : "";
+    }
+    if (!ok) {
+        *err = "could not read every snapshot of " + dest;
+    } else if (!window.empty() && !write_snapshot_catalog(dest, result)) {
+        *err = "cannot write " + catalog_path(dest) + ": " + std::strerror(errno);
+        ok = false;
+    }
+    if (out) *out = std::move(result);
+    return ok;
+}
+
+static uint64_t fnv1a64(const char *data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Exclude lists are written once per distinct content to
+// <runtime_dir>/excludes-<hash>, so concurrent jobs and runs can share them.
+static bool prepare_excludes_file(const std::vector<std::string> &excludes, const std::string &runtime_dir, const RunMode &mode, std::string *path) {
+    std::string content;
+    for (const auto &ex : excludes) content += ex + '\n';
+    char name[64];
+    std::snprintf(name, sizeof(name), "/excludes-%016llx", static_cast<unsigned long long>(fnv1a64(content.data(), content.size())));
+    *path = runtime_dir + name;
+    if (mode.dry_run) {
+        std::printf("dry-run: would write excludes file %s\n", path->c_str());
+        return true;
+    }
+    mkdir(runtime_dir.c_str(), 0755);
+    FILE *existing = std::fopen(path->c_str(), "r");
+    if (existing) {
+        std::string current(content.size() + 1, '\0');
+        size_t n = std::fread(&current[0], 1, current.size(), existing);
+        std::fclose(existing);
+        if (n == content.size() && current.compare(0, n, content) == 0) return true;
+    }
+    std::string tmp = *path + ".tmp." + std::to_string(getpid());
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    bool ok = std::fwrite(content.data(), 1, content.size(), f) == content.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path->c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool verify_destination(const Job &job, const std::string &mount_prefix, std::string *err) {
+    if (job.dest.empty()) {
+        *err = "destination path is empty";
+        return false;
+    }
+    if (job.mount.empty()) {
+        *err = "mount is required for all jobs";
+        return false;
+    }
+    if (!mount_prefix.empty() && job.mount.rfind(mount_prefix, 0) != 0) {
+        *err = "mount " + job.mount + " does not start with required prefix " + mount_prefix;
+        return false;
+    }
+    char dest_real[PATH_MAX];
+    char mount_real[PATH_MAX];
+    if (!realpath(job.dest.c_str(), dest_real)) {
+        *err = "cannot access destination " + job.dest + ": " + std::strerror(errno);
+        return false;
+    }
+    if (std::strcmp(dest_real, "/") == 0) {
+        *err = "destination resolves to /";
+        return false;
+    }
+    if (!realpath(job.mount.c_str(), mount_real)) {
+        *err = "cannot access mount " + job.mount + ": " + std::strerror(errno);
+        return false;
+    }
+    if (std::strcmp(mount_real, "/") == 0) {
+        *err = "mount resolves to /";
+        return false;
     }
     size_t mount_len = std::strlen(mount_real);
     if (std::strncmp(dest_real, mount_real, mount_len) != 0 ||
@@ -641,20 +2600,6 @@ static bool verify_destination(const Job &job, const std::string &mount_prefix,
     return true;
 }
 
-static int find_job_index(const Config &cfg, const std::string &name) {
-    for (size_t i = 0; i < cfg.jobs.size(); i++) {
-        if (cfg.jobs[i].name == name) return static_cast<int>(i);
-    }
-    return -1;
-}
-
-static bool job_depends_on(const Job &job, const std::string &name) {
-    for (const auto &dep : job.depends_on) {
-        if (dep == name) return true;
-    }
-    return false;
-}
-
 static bool is_safe_job_name(const std::string &name) {
     if (name.empty() || name == "." || name == "..") return false;
     for (char c : name) {
@@ -688,6 +2633,41 @@ static bool validate_job_names(const Config &cfg, std::string *err) {
     return true;
 }
 
+struct JobGraph {
+    std::unordered_map<std::string, int> index;
+    std::vector<std::vector<int>> deps;
+    std::vector<std::vector<int>> dependents;
+};
+
+static int find_job_index(const JobGraph &graph, const std::string &name) {
+    auto it = graph.index.find(name);
+    return it == graph.index.end() ? -1 : it->second;
+}
+
+static bool build_job_graph(const Config &cfg, JobGraph *graph, std::string *err) {
+    graph->index.clear();
+    graph->index.reserve(cfg.jobs.size());
+    graph->deps.assign(cfg.jobs.size(), std::vector<int>());
+    graph->dependents.assign(cfg.jobs.size(), std::vector<int>());
+    for (size_t i = 0; i < cfg.jobs.size(); i++) {
+        graph->index.emplace(cfg.jobs[i].name, static_cast<int>(i));
+    }
+    for (size_t i = 0; i < cfg.jobs.size(); i++) {
+        std::vector<int> &deps = graph->deps[i];
+        for (const auto &dep : cfg.jobs[i].depends_on) {
+            int dep_idx = find_job_index(*graph, dep);
+            if (dep_idx < 0) {
+                *err = "dependency " + dep + " not found for job " + cfg.jobs[i].name;
+                return false;
+            }
+            if (std::find(deps.begin(), deps.end(), dep_idx) != deps.end()) continue;
+            deps.push_back(dep_idx);
+            graph->dependents[dep_idx].push_back(static_cast<int>(i));
+        }
+    }
+    return true;
+}
+
 struct StackItem {
     int idx;
     int parent;
@@ -696,13 +2676,14 @@ struct StackItem {
 
 static bool collect_jobs_with_deps(
     const Config &cfg,
+    const JobGraph &graph,
     const std::vector<std::string> &roots,
     std::vector<int> *included,
     std::string *err
 ) {
     std::vector<StackItem> stack;
     for (const auto &name : roots) {
-        int idx = find_job_index(cfg, name);
+        int idx = find_job_index(graph, name);
         if (idx < 0) {
             *err = "job not found: " + name;
             return false;
@@ -723,75 +2704,511 @@ static bool collect_jobs_with_deps(
             return false;
         }
         (*included)[item.idx] = 1;
-        for (const auto &dep : job.depends_on) {
-            int dep_idx = find_job_index(cfg, dep);
-            if (dep_idx < 0) {
-                *err = "dependency " + dep + " not found for job " + job.name;
-                return false;
-            }
+        for (int dep_idx : graph.deps[item.idx]) {
             stack.push_back({dep_idx, item.idx, true});
         }
     }
     return true;
 }
 
+static std::string describe_cycle(const Config &cfg, const JobGraph &graph, const std::vector<int> &indegree) {
+    int start = -1;
+    for (size_t i = 0; i < indegree.size(); i++) {
+        if (indegree[i] > 0) {
+            start = static_cast<int>(i);
+            break;
+        }
+    }
+    if (start < 0) return "";
+    std::vector<int> seen_at(indegree.size(), -1);
+    std::vector<int> path;
+    int cur = start;
+    while (seen_at[cur] < 0) {
+        seen_at[cur] = static_cast<int>(path.size());
+        path.push_back(cur);
+        for (int dep : graph.deps[cur]) {
+            if (indegree[dep] > 0) {
+                cur = dep;
+                break;
+            }
+        }
+    }
+    std::string out;
+    for (size_t i = static_cast<size_t>(seen_at[cur]); i < path.size(); i++) {
+        out += cfg.jobs[path[i]].name + " -> ";
+    }
+    return out + cfg.jobs[cur].name;
+}
+
+typedef std::priority_queue<int, std::vector<int>, std::greater<int>> MinIndexHeap;
+
+// Kahn's algorithm over the included subset. Ready jobs are taken in config
+// order, so the only cost over O(V+E) is the heap. With mount_affinity, a
+// ready job on the mount of the previously emitted job goes first, grouping
+// work per disk without breaking depends_on.
 static bool topo_sort_jobs(
     const Config &cfg,
+    const JobGraph &graph,
     const std::vector<int> &included,
-    std::vector<Job> *out,
+    bool mount_affinity,
+    std::vector<int> *out,
     std::string *err
 ) {
     std::vector<int> indegree(cfg.jobs.size(), 0);
-    std::vector<int> processed(cfg.jobs.size(), 0);
+    std::vector<int> mount_id(cfg.jobs.size(), 0);
+    std::unordered_map<std::string, int> mount_ids;
+    MinIndexHeap ready;
     size_t subset_count = 0;
     for (size_t i = 0; i < cfg.jobs.size(); i++) {
         if (!included[i]) continue;
         subset_count++;
-        for (const auto &dep : cfg.jobs[i].depends_on) {
-            int dep_idx = find_job_index(cfg, dep);
-            if (dep_idx < 0 || !included[dep_idx]) {
-                *err = "dependency " + dep + " not found for job " + cfg.jobs[i].name;
+        mount_id[i] = mount_ids.emplace(cfg.jobs[i].mount, static_cast<int>(mount_ids.size())).first->second;
+        for (int dep_idx : graph.deps[i]) {
+            if (!included[dep_idx]) {
+                *err = "dependency " + cfg.jobs[dep_idx].name + " not found for job " + cfg.jobs[i].name;
                 return false;
             }
             indegree[i]++;
         }
     }
+    std::vector<MinIndexHeap> ready_by_mount(mount_affinity ? mount_ids.size() : 0);
+    std::vector<char> emitted(cfg.jobs.size(), 0);
+    auto push_ready = [&](int idx) {
+        ready.push(idx);
+        if (mount_affinity) ready_by_mount[mount_id[idx]].push(idx);
+    };
+    for (size_t i = 0; i < cfg.jobs.size(); i++) {
+        if (included[i] && indegree[i] == 0) push_ready(static_cast<int>(i));
+    }
     out->clear();
-    while (out->size() < subset_count) {
-        bool found = false;
-        for (size_t i = 0; i < cfg.jobs.size(); i++) {
-            if (!included[i] || processed[i]) continue;
-            if (indegree[i] != 0) continue;
-            out->push_back(cfg.jobs[i]);
-            processed[i] = 1;
-            found = true;
-            for (size_t j = 0; j < cfg.jobs.size(); j++) {
-                if (!included[j] || processed[j]) continue;
-                if (job_depends_on(cfg.jobs[j], cfg.jobs[i].name)) {
-                    indegree[j]--;
-                }
+    out->reserve(subset_count);
+    int current_mount = -1;
+    for (;;) {
+        int idx = -1;
+        if (current_mount >= 0) {
+            MinIndexHeap &same = ready_by_mount[current_mount];
+            while (!same.empty() && emitted[same.top()]) same.pop();
+            if (!same.empty()) {
+                idx = same.top();
+                same.pop();
             }
         }
-        if (!found) {
-            *err = "job dependencies contain a cycle";
-            return false;
+        if (idx < 0) {
+            while (!ready.empty() && emitted[ready.top()]) ready.pop();
+            if (ready.empty()) break;
+            idx = ready.top();
+            ready.pop();
+        }
+        emitted[idx] = 1;
+        if (mount_affinity) current_mount = mount_id[idx];
+        out->push_back(idx);
+        for (int dependent : graph.dependents[idx]) {
+            if (included[dependent] && --indegree[dependent] == 0) {
+                push_ready(dependent);
+            }
         }
     }
+    if (out->size() != subset_count) {
+        *err = "job dependencies contain a cycle: " + describe_cycle(cfg, graph, indegree);
+        return false;
+    }
     return true;
 }
 
-static bool init_timevault(const std::string &mount, const std::string &mount_prefix, const RunMode &mode, bool force_init, std::string *err) {
-    if (mount.empty()) {
-        *err = "mount path is empty";
-        return false;
-    }
-    if (!mount_prefix.empty() && mount.rfind(mount_prefix, 0) != 0) {
-        *err = "mount " + mount + " does not start with required prefix " + mount_prefix;
-        return false;
+static int count_mount_transitions(const std::vector<Job> &jobs, const std::vector<int> &order) {
+    int transitions = 0;
+    for (size_t i = 1; i < order.size(); i++) {
+        if (jobs[order[i]].mount != jobs[order[i - 1]].mount) transitions++;
     }
-    char mount_real[PATH_MAX];
-    if (!realpath(mount.c_str(), mount_real)) {
-        *err = "cannot access mount " + mount + ": " + std::strerror(errno);
+    return transitions;
+}
+
+
+// Compiled config cache: a flat image of a parsed and validated config,
+// stored as <config>.cache and reused while the YAML content hash matches.
+// Layout: header, CacheJob array, CacheStr array, uint32 array, string bytes.
+static const char CONFIG_CACHE_MAGIC[8] = {'T', 'V', 'C', 'F', 'G', 'I', 'M', 'G'};
+static const uint32_t CONFIG_CACHE_VERSION = 5;
+
+struct CacheStr {
+    uint32_t off;
+    uint32_t len;
+};
+
+struct CacheList {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t total_size;
+    uint64_t yaml_hash;
+    uint64_t yaml_size;
+    CacheStr mount_prefix;
+    CacheStr history_path;
+    CacheStr runtime_dir;
+    CacheStr prometheus_textfile;
+    uint32_t lock_source_device;
+    uint32_t manifests;
+    int32_t limits[4];
+    CacheList excludes;
+    CacheList exclude_sets;
+    CacheList order;
+    uint32_t job_count;
+    uint32_t jobs_offset;
+    uint32_t strs_offset;
+    uint32_t strs_count;
+    uint32_t ints_offset;
+    uint32_t ints_count;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+};
+
+struct CacheJob {
+    CacheStr name;
+    CacheStr source;
+    CacheStr dest;
+    CacheStr mount;
+    CacheStr schedule;
+    int32_t copies;
+    uint32_t run_policy;
+    uint32_t exclude_set;
+    CacheList depends_on;
+    CacheList deps;
+};
+
+struct CacheBuilder {
+    std::string strings;
+    std::unordered_map<std::string, CacheStr> interned;
+    std::vector<CacheStr> strs;
+    std::vector<uint32_t> ints;
+};
+
+static CacheStr cache_intern(CacheBuilder *b, const std::string &value) {
+    auto it = b->interned.find(value);
+    if (it != b->interned.end()) return it->second;
+    CacheStr ref = {static_cast<uint32_t>(b->strings.size()), static_cast<uint32_t>(value.size())};
+    b->strings += value;
+    b->interned.emplace(value, ref);
+    return ref;
+}
+
+static CacheList cache_str_list(CacheBuilder *b, const std::vector<std::string> &values) {
+    CacheList list = {static_cast<uint32_t>(b->strs.size()), static_cast<uint32_t>(values.size())};
+    for (const auto &value : values) b->strs.push_back(cache_intern(b, value));
+    return list;
+}
+
+static CacheList cache_int_list(CacheBuilder *b, const std::vector<int> &values) {
+    CacheList list = {static_cast<uint32_t>(b->ints.size()), static_cast<uint32_t>(values.size())};
+    for (int value : values) b->ints.push_back(static_cast<uint32_t>(value));
+    return list;
+}
+
+static std::string config_cache_path(const std::string &config_path) {
+    return config_path + ".cache";
+}
+
+static bool write_config_cache(
+    const std::string &path,
+    uint64_t yaml_hash,
+    uint64_t yaml_size,
+    const Config &cfg,
+    const JobGraph &graph,
+    const std::vector<int> &order
+) {
+    CacheBuilder b;
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CONFIG_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CONFIG_CACHE_VERSION;
+    header.yaml_hash = yaml_hash;
+    header.yaml_size = yaml_size;
+    header.mount_prefix = cache_intern(&b, cfg.mount_prefix);
+    header.history_path = cache_intern(&b, cfg.history_path);
+    header.runtime_dir = cache_intern(&b, cfg.runtime_dir);
+    header.prometheus_textfile = cache_intern(&b, cfg.prometheus_textfile);
+    header.lock_source_device = cfg.lock_source_device ? 1 : 0;
+    header.manifests = (cfg.manifests ? 1u : 0u) | (cfg.manifest_hashes ? 2u : 0u);
+    header.limits[0] = cfg.limits.jobs;
+    header.limits[1] = cfg.limits.per_disk;
+    header.limits[2] = cfg.limits.per_source;
+    header.limits[3] = cfg.limits.per_host;
+    header.excludes = cache_str_list(&b, cfg.excludes);
+    std::vector<int> set_refs;
+    for (const auto &set : cfg.exclude_sets) {
+        CacheList list = cache_str_list(&b, set);
+        set_refs.push_back(static_cast<int>(list.first));
+        set_refs.push_back(static_cast<int>(list.count));
+    }
+    header.exclude_sets = cache_int_list(&b, set_refs);
+    header.order = cache_int_list(&b, order);
+    std::vector<CacheJob> jobs(cfg.jobs.size());
+    for (size_t i = 0; i < cfg.jobs.size(); i++) {
+        const Job &job = cfg.jobs[i];
+        CacheJob &out = jobs[i];
+        out.name = cache_intern(&b, job.name);
+        out.source = cache_intern(&b, job.source);
+        out.dest = cache_intern(&b, job.dest);
+        out.mount = cache_intern(&b, job.mount);
+        out.schedule = cache_intern(&b, job.schedule);
+        out.copies = job.copies;
+        out.run_policy = static_cast<uint32_t>(job.run_policy);
+        out.exclude_set = static_cast<uint32_t>(job.exclude_set);
+        out.depends_on = cache_str_list(&b, job.depends_on);
+        out.deps = cache_int_list(&b, graph.deps[i]);
+    }
+    header.job_count = static_cast<uint32_t>(jobs.size());
+    header.jobs_offset = sizeof(CacheHeader);
+    header.strs_offset = header.jobs_offset + static_cast<uint32_t>(jobs.size() * sizeof(CacheJob));
+    header.strs_count = static_cast<uint32_t>(b.strs.size());
+    header.ints_offset = header.strs_offset + static_cast<uint32_t>(b.strs.size() * sizeof(CacheStr));
+    header.ints_count = static_cast<uint32_t>(b.ints.size());
+    header.strings_offset = header.ints_offset + static_cast<uint32_t>(b.ints.size() * sizeof(uint32_t));
+    header.strings_size = static_cast<uint32_t>(b.strings.size());
+    uint64_t total = static_cast<uint64_t>(header.strings_offset) + b.strings.size();
+    if (total > UINT32_MAX) return false;
+    header.total_size = static_cast<uint32_t>(total);
+
+    std::string image;
+    image.reserve(header.total_size);
+    image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char *>(jobs.data()), jobs.size() * sizeof(CacheJob));
+    image.append(reinterpret_cast<const char *>(b.strs.data()), b.strs.size() * sizeof(CacheStr));
+    image.append(reinterpret_cast<const char *>(b.ints.data()), b.ints.size() * sizeof(uint32_t));
+    image += b.strings;
+
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    int fd = ::open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    size_t done = 0;
+    while (done < image.size()) {
+        ssize_t n = ::write(fd, image.data() + done, image.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    bool ok = done == image.size();
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool cache_str_ok(const CacheHeader &h, const CacheStr &ref) {
+    return ref.off <= h.strings_size && ref.len <= h.strings_size - ref.off;
+}
+
+static bool cache_list_ok(const CacheList &list, uint32_t count) {
+    return list.first <= count && list.count <= count - list.first;
+}
+
+// Only trusts an image that matches the YAML hash and size, is owned by the
+// YAML's owner, and whose every offset stays inside the mapping.
+static bool load_config_cache(
+    const std::string &path,
+    uint64_t yaml_hash,
+    uint64_t yaml_size,
+    uid_t yaml_uid,
+    Config *cfg,
+    JobGraph *graph,
+    std::vector<int> *order
+) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    // Trusted only if nobody but the config's owner could have written it.
+    if (fstat(fd, &st) != 0 || st.st_uid != yaml_uid || (st.st_mode & 022) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(CacheHeader)) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+    const char *base = static_cast<const char *>(map);
+    CacheHeader h;
+    std::memcpy(&h, base, sizeof(h));
+    bool ok = std::memcmp(h.magic, CONFIG_CACHE_MAGIC, sizeof(h.magic)) == 0 &&
+        h.version == CONFIG_CACHE_VERSION &&
+        h.yaml_hash == yaml_hash &&
+        h.yaml_size == yaml_size &&
+        h.total_size == size &&
+        h.jobs_offset == sizeof(CacheHeader) &&
+        h.strs_offset == h.jobs_offset + static_cast<uint64_t>(h.job_count) * sizeof(CacheJob) &&
+        h.ints_offset == h.strs_offset + static_cast<uint64_t>(h.strs_count) * sizeof(CacheStr) &&
+        h.strings_offset == h.ints_offset + static_cast<uint64_t>(h.ints_count) * sizeof(uint32_t) &&
+        static_cast<uint64_t>(h.strings_offset) + h.strings_size == size;
+    const CacheStr *strs = reinterpret_cast<const CacheStr *>(base + h.strs_offset);
+    const uint32_t *ints = reinterpret_cast<const uint32_t *>(base + h.ints_offset);
+    const char *strings = base + h.strings_offset;
+    auto str = [&](const CacheStr &ref) { return std::string(strings + ref.off, ref.len); };
+    auto str_list = [&](const CacheList &list, std::vector<std::string> *out) {
+        if (!cache_list_ok(list, h.strs_count)) return false;
+        out->reserve(list.count);
+        for (uint32_t i = 0; i < list.count; i++) {
+            if (!cache_str_ok(h, strs[list.first + i])) return false;
+            out->push_back(str(strs[list.first + i]));
+        }
+        return true;
+    };
+    auto int_list = [&](const CacheList &list, std::vector<int> *out) {
+        if (!cache_list_ok(list, h.ints_count)) return false;
+        out->reserve(list.count);
+        for (uint32_t i = 0; i < list.count; i++) {
+            if (ints[list.first + i] >= h.job_count) return false;
+            out->push_back(static_cast<int>(ints[list.first + i]));
+        }
+        return true;
+    };
+
+    Config loaded;
+    JobGraph loaded_graph;
+    std::vector<int> loaded_order;
+    ok = ok && cache_str_ok(h, h.mount_prefix) && cache_str_ok(h, h.history_path) &&
+        cache_str_ok(h, h.runtime_dir) && cache_str_ok(h, h.prometheus_textfile) &&
+        str_list(h.excludes, &loaded.excludes) && int_list(h.order, &loaded_order) &&
+        loaded_order.size() == h.job_count &&
+        cache_list_ok(h.exclude_sets, h.ints_count) && h.exclude_sets.count % 2 == 0 && h.exclude_sets.count > 0;
+    for (uint32_t i = 0; ok && i < h.exclude_sets.count; i += 2) {
+        CacheList set = {ints[h.exclude_sets.first + i], ints[h.exclude_sets.first + i + 1]};
+        loaded.exclude_sets.emplace_back();
+        ok = str_list(set, &loaded.exclude_sets.back());
+    }
+    if (ok) {
+        loaded.mount_prefix = str(h.mount_prefix);
+        loaded.history_path = str(h.history_path);
+        loaded.runtime_dir = str(h.runtime_dir);
+        loaded.prometheus_textfile = str(h.prometheus_textfile);
+        loaded.lock_source_device = h.lock_source_device != 0;
+        loaded.manifests = (h.manifests & 1u) != 0;
+        loaded.manifest_hashes = (h.manifests & 2u) != 0;
+        loaded.limits.jobs = h.limits[0];
+        loaded.limits.per_disk = h.limits[1];
+        loaded.limits.per_source = h.limits[2];
+        loaded.limits.per_host = h.limits[3];
+        loaded.jobs.resize(h.job_count);
+        loaded_graph.deps.resize(h.job_count);
+        loaded_graph.dependents.resize(h.job_count);
+        loaded_graph.index.reserve(h.job_count);
+    }
+    for (uint32_t i = 0; ok && i < h.job_count; i++) {
+        CacheJob cj;
+        std::memcpy(&cj, base + h.jobs_offset + i * sizeof(CacheJob), sizeof(cj));
+        Job &job = loaded.jobs[i];
+        ok = cache_str_ok(h, cj.name) && cache_str_ok(h, cj.source) && cache_str_ok(h, cj.dest) &&
+            cache_str_ok(h, cj.mount) && cache_str_ok(h, cj.schedule) && cj.run_policy <= static_cast<uint32_t>(RunPolicy::Off) &&
+            cj.exclude_set < loaded.exclude_sets.size() && str_list(cj.depends_on, &job.depends_on) &&
+            int_list(cj.deps, &loaded_graph.deps[i]);
+        if (!ok) break;
+        job.name = str(cj.name);
+        job.source = str(cj.source);
+        job.dest = str(cj.dest);
+        job.mount = str(cj.mount);
+        job.schedule = str(cj.schedule);
+        job.copies = cj.copies;
+        job.run_policy = static_cast<RunPolicy>(cj.run_policy);
+        job.exclude_set = static_cast<int>(cj.exclude_set);
+        loaded_graph.index.emplace(job.name, static_cast<int>(i));
+        for (int dep : loaded_graph.deps[i]) {
+            loaded_graph.dependents[dep].push_back(static_cast<int>(i));
+        }
+    }
+    munmap(map, size);
+    if (!ok) return false;
+    *cfg = std::move(loaded);
+    *graph = std::move(loaded_graph);
+    *order = std::move(loaded_order);
+    return true;
+}
+
+static bool read_file(const std::string &path, std::string *out, struct stat *st) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    if (fstat(fd, st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    char buf[65536];
+    for (;;) {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ::close(fd);
+            return false;
+        }
+        if (n == 0) break;
+        out->append(buf, static_cast<size_t>(n));
+    }
+    ::close(fd);
+    return true;
+}
+
+// Loads, validates and dependency-sorts the config, going through the
+// compiled cache when it is current and refreshing it otherwise (unless
+// write_cache is false, for commands that only read the config).
+static bool load_config(
+    const std::string &path,
+    const RunMode &mode,
+    bool use_cache,
+    Config *cfg,
+    JobGraph *graph,
+    std::vector<int> *config_order,
+    std::string *err,
+    bool write_cache = true
+) {
+    std::string content;
+    struct stat st;
+    if (!read_file(path, &content, &st)) {
+        *err = "cannot read " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    uint64_t hash = fnv1a64(content.data(), content.size());
+    std::string cache_path = config_cache_path(path);
+    if (use_cache && load_config_cache(cache_path, hash, content.size(), st.st_uid, cfg, graph, config_order)) {
+        if (mode.verbose) {
+            std::printf("using compiled config %s\n", cache_path.c_str());
+        }
+        return true;
+    }
+    try {
+        if (!parse_config_node(YAML::Load(content), cfg, err)) return false;
+    } catch (const std::exception &e) {
+        *err = e.what();
+        return false;
+    }
+    std::vector<int> all_included(cfg->jobs.size(), 1);
+    if (!validate_job_names(*cfg, err) ||
+        !build_job_graph(*cfg, graph, err) ||
+        !topo_sort_jobs(*cfg, *graph, all_included, false, config_order, err)) {
+        return false;
+    }
+    if (use_cache && write_cache && !mode.dry_run) {
+        bool written = write_config_cache(cache_path, hash, content.size(), *cfg, *graph, *config_order);
+        if (mode.verbose) {
+            std::printf("%s compiled config %s\n", written ? "wrote" : "could not write", cache_path.c_str());
+        }
+    }
+    return true;
+}
+
+static bool init_timevault(const std::string &mount, const std::string &mount_prefix, const RunMode &mode, bool force_init, std::string *err) {
+    if (mount.empty()) {
+        *err = "mount path is empty";
+        return false;
+    }
+    if (!mount_prefix.empty() && mount.rfind(mount_prefix, 0) != 0) {
+        *err = "mount " + mount + " does not start with required prefix " + mount_prefix;
+        return false;
+    }
+    char mount_real[PATH_MAX];
+    if (!realpath(mount.c_str(), mount_real)) {
+        *err = "cannot access mount " + mount + ": " + std::strerror(errno);
         return false;
     }
     if (std::strcmp(mount_real, "/") == 0) {
@@ -847,208 +3264,2864 @@ static bool init_timevault(const std::string &mount, const std::string &mount_pr
             *err = "mount " + std::string(mount_real) + " is not empty; aborting init (use --force-init to override)";
         }
     }
-
-    if (err->empty()) {
-        std::string marker = std::string(mount_real) + "/" + TIMEVAULT_MARKER;
-        if (access(marker.c_str(), F_OK) == 0) {
-            std::printf("timevault marker already exists: %s\n", marker.c_str());
-        } else if (mode.dry_run) {
-            std::printf("dry-run: touch %s\n", marker.c_str());
+
+    if (err->empty()) {
+        std::string marker = std::string(mount_real) + "/" + TIMEVAULT_MARKER;
+        if (access(marker.c_str(), F_OK) == 0) {
+            std::printf("timevault marker already exists: %s\n", marker.c_str());
+        } else if (mode.dry_run) {
+            std::printf("dry-run: touch %s\n", marker.c_str());
+        } else {
+            FILE *mf = std::fopen(marker.c_str(), "w");
+            if (!mf) {
+                *err = "create " + marker + ": " + std::strerror(errno);
+            } else {
+                std::fclose(mf);
+            }
+        }
+    }
+
+    run_command({"mount", "-oremount,ro", mount}, mode);
+    run_command({"umount", mount}, mode);
+    untrack_mount(mount);
+
+    return err->empty();
+}
+
+static void format_time(char *buf, size_t len, time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    std::strftime(buf, len, "%d-%m-%Y %H:%M", &tm);
+}
+
+static void format_day(char *buf, size_t len, time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    std::strftime(buf, len, "%Y%m%d", &tm);
+}
+
+static int acquire_job_lock(const Job &job, const std::string &path, const RunMode &mode, FileLock *lock, JobMetrics *job_metrics, bool shared = false) {
+    double waited = 0.0;
+    int lock_rc = lock_acquire(path, mode.lock_wait_sec, lock, &waited, shared);
+    job_metrics->lock_wait_sec += waited;
+    if (lock_rc < 0) {
+        std::printf("failed to lock %s: %s (need write permission; try sudo or adjust permissions)\n", path.c_str(), std::strerror(errno));
+    } else if (waited >= 0.2) {
+        std::printf("job %s waited %.1fs for lock %s\n", job.name.c_str(), waited, path.c_str());
+    }
+    return lock_rc;
+}
+
+// opening is set while one thread takes the mount lock and mounts the
+// disk without holding mu (the lock can wait forever with --lock-wait -1);
+// other users of the mount wait on cv for the outcome. read_only sessions
+// (search, restore, history mount) share the mount lock with each other
+// and keep the disk mounted ro; backups wait for them to finish.
+struct MountSession {
+    std::mutex mu;
+    std::condition_variable cv;
+    int users = 0;
+    int pending = 0;
+    bool open = false;
+    bool opening = false;
+    bool read_only = false;
+    FileLock lock;
+};
+
+static std::mutex mount_sessions_mutex;
+static std::map<std::string, MountSession> mount_sessions;
+static std::atomic<int> mount_session_opens(0);
+
+static MountSession &mount_session(const std::string &mount) {
+    std::lock_guard<std::mutex> guard(mount_sessions_mutex);
+    return mount_sessions[mount];
+}
+
+// Caller holds session->mu.
+static void mount_session_close(const std::string &mount, MountSession *session, const RunMode &mode) {
+    if (!session->open) return;
+    if (mode.verbose) {
+        std::printf("closing mount session %s\n", mount.c_str());
+    }
+    // Another reader may still be using the disk; the last one unmounts.
+    if (session->read_only && !lock_try_exclusive(&session->lock)) {
+        untrack_mount(mount);
+        lock_release(&session->lock);
+        session->open = false;
+        return;
+    }
+    double t = phase_begin("remount ro");
+    run_command({"mount", "-oremount,ro", mount}, mode);
+    phase_end("remount ro", t);
+    t = phase_begin("umount");
+    run_command({"umount", mount}, mode);
+    phase_end("umount", t);
+    untrack_mount(mount);
+    lock_release(&session->lock);
+    session->open = false;
+}
+
+// Registers a scheduled job that will use the mount; the mount stays up
+// until every expected job has called mount_session_finish.
+static void mount_session_expect(const std::string &mount) {
+    MountSession &session = mount_session(mount);
+    std::lock_guard<std::mutex> guard(session.mu);
+    session.pending++;
+}
+
+static void mount_session_finish(const std::string &mount, const RunMode &mode) {
+    MountSession &session = mount_session(mount);
+    std::lock_guard<std::mutex> guard(session.mu);
+    if (session.pending > 0) session.pending--;
+    if (session.users == 0 && session.pending == 0) {
+        mount_session_close(mount, &session, mode);
+    }
+}
+
+// Takes the mount lock shared and mounts the disk ro, or leaves it
+// mounted when another reader already has it.
+static bool mount_session_open_ro(const Job &job, const RunMode &mode, FileLock *lock, std::string *err) {
+    double t = phase_begin("mount");
+    if (mount_is_mounted(job.mount)) {
+        run_command({"mount", "-oremount,ro", job.mount}, mode);
+    } else {
+        run_command({"mount", "-oro", job.mount}, mode);
+    }
+    if (mount_is_mounted(job.mount)) {
+        track_mount(job.mount);
+    }
+    int ro = mount_is_readonly(job.mount);
+    phase_end("mount", t);
+    if (ro != 1 && !mode.dry_run) {
+        *err = ro < 0 ? "mount " + job.mount + " is not mounted" : "mount " + job.mount + " did not remount read-only";
+        untrack_mount(job.mount);
+        lock_release(lock);
+        return false;
+    }
+    return true;
+}
+
+// Takes the mount lock, mounts the disk and remounts it rw.
+static bool mount_session_open(const Job &job, const RunMode &mode, bool read_only, FileLock *lock, JobMetrics *job_metrics, std::string *err) {
+    if (!mode.dry_run) {
+        double t = phase_begin("mount lock");
+        int lock_rc = acquire_job_lock(job, mount_lock_path(job.mount), mode, lock, job_metrics, read_only);
+        phase_end("mount lock", t);
+        if (lock_rc != 1) {
+            *err = lock_rc == 0 ? "mount " + job.mount + " is in use by another job" : "cannot lock mount " + job.mount;
+            return false;
+        }
+    }
+    if (read_only) return mount_session_open_ro(job, mode, lock, err);
+    double t = phase_begin("unmount check");
+    bool unmounted = ensure_unmounted(job.mount, mode, err);
+    phase_end("unmount check", t);
+    if (!unmounted) {
+        lock_release(lock);
+        return false;
+    }
+    t = phase_begin("mount");
+    run_command({"mount", job.mount}, mode);
+    if (mount_is_mounted(job.mount)) {
+        track_mount(job.mount);
+    }
+    phase_end("mount", t);
+    t = phase_begin("remount rw");
+    run_command({"mount", "-oremount,rw", job.mount}, mode);
+    int ro = mount_is_readonly(job.mount);
+    phase_end("remount rw", t);
+    if (ro != 0) {
+        if (ro < 0) {
+            *err = "mount " + job.mount + " is not mounted";
+        } else {
+            *err = "mount " + job.mount + " is read-only";
+        }
+        run_command({"mount", "-oremount,ro", job.mount}, mode);
+        run_command({"umount", job.mount}, mode);
+        untrack_mount(job.mount);
+        lock_release(lock);
+        return false;
+    }
+    return true;
+}
+
+// The first user opens the session; later users share that mount.
+static bool mount_session_acquire(const Job &job, const RunMode &mode, JobMetrics *job_metrics, std::string *err, bool read_only = false) {
+    MountSession &session = mount_session(job.mount);
+    std::unique_lock<std::mutex> guard(session.mu);
+    session.cv.wait(guard, [&]() { return !session.opening; });
+    if (session.open) {
+        session.users++;
+        if (mode.verbose) {
+            std::printf("reusing mount session %s (%d user(s))\n", job.mount.c_str(), session.users);
+        }
+        return true;
+    }
+    session.opening = true;
+    guard.unlock();
+    bool ok = mount_session_open(job, mode, read_only, &session.lock, job_metrics, err);
+    guard.lock();
+    session.opening = false;
+    if (ok) {
+        session.open = true;
+        session.read_only = read_only;
+        session.users++;
+        mount_session_opens++;
+    }
+    session.cv.notify_all();
+    return ok;
+}
+
+static void mount_session_release(const std::string &mount, const RunMode &mode) {
+    MountSession &session = mount_session(mount);
+    std::lock_guard<std::mutex> guard(session.mu);
+    if (session.users > 0) session.users--;
+    if (session.users == 0 && session.pending == 0) {
+        mount_session_close(mount, &session, mode);
+    } else if (mode.verbose) {
+        std::printf("keeping %s mounted (%d user(s), %d pending job(s))\n", mount.c_str(), session.users, session.pending);
+    }
+}
+
+// Ends a run: every session is closed and forgotten, so counts left by
+// jobs that never finished do not carry into the next daemon run.
+static void mount_sessions_close_all(const RunMode &mode) {
+    std::lock_guard<std::mutex> guard(mount_sessions_mutex);
+    for (auto &entry : mount_sessions) {
+        std::lock_guard<std::mutex> session_guard(entry.second.mu);
+        mount_session_close(entry.first, &entry.second, mode);
+    }
+    mount_sessions.clear();
+}
+
+static int backup_job(const Job &job, const std::vector<std::string> &rsync_extra, const RunMode &mode, const Config &cfg, const std::string &excludes_path, JobMetrics *job_metrics) {
+    job_metrics->name = job.name;
+    FileLock job_lock;
+    FileLock source_lock;
+    if (!mode.dry_run) {
+        if (!is_safe_job_name(job.name)) {
+            std::printf("job %s name must use only letters, digits, '.', '-', '_'\n", job.name.empty() ? "<unnamed>" : job.name.c_str());
+            return 2;
+        }
+        double t = phase_begin("lock");
+        int lock_rc = acquire_job_lock(job, job_lock_path(job.name), mode, &job_lock, job_metrics);
+        phase_end("lock", t);
+        if (lock_rc == 0) {
+            std::printf("job %s is already running\n", job.name.c_str());
+            return 3;
+        }
+        if (lock_rc < 0) {
+            return 2;
+        }
+    }
+    if (mode.verbose) {
+        const char *policy = job.run_policy == RunPolicy::Auto ? "auto" : (job.run_policy == RunPolicy::Demand ? "demand" : "off");
+        std::printf("job: %s\n", job.name.c_str());
+        std::printf("  run: %s\n", policy);
+        std::printf("  source: %s\n", job.source.c_str());
+        std::printf("  dest: %s\n", job.dest.c_str());
+        std::printf("  mount: %s\n", job.mount.empty() ? "<unset>" : job.mount.c_str());
+        std::printf("  copies: %d\n", job.copies);
+        std::printf("  excludes: %zu (%s)\n", cfg.exclude_sets[job.exclude_set].size(), excludes_path.c_str());
+    }
+    if (excludes_path.empty()) {
+        std::printf("skip job %s: no excludes file in %s\n", job.name.c_str(), cfg.runtime_dir.c_str());
+        lock_release(&job_lock);
+        return 1;
+    }
+
+    time_t now = time(nullptr) - 86400;
+    char backup_day[32];
+    format_day(backup_day, sizeof(backup_day), now);
+    if (mode.verbose) {
+        std::printf("  backup day: %s\n", backup_day);
+    }
+
+    if (job.mount.empty()) {
+        std::printf("skip job %s: mount is required for all jobs\n", job.name.c_str());
+        lock_release(&job_lock);
+        return 1;
+    }
+    std::string err;
+    if (!mount_session_acquire(job, mode, job_metrics, &err)) {
+        std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
+        lock_release(&job_lock);
+        return 1;
+    }
+    if (!mode.dry_run && cfg.lock_source_device) {
+        std::string source_path;
+        if (source_lock_path(job.source, &source_path)) {
+            double t = phase_begin("source lock");
+            int lock_rc = acquire_job_lock(job, source_path, mode, &source_lock, job_metrics);
+            phase_end("source lock", t);
+            if (lock_rc != 1) {
+                if (lock_rc == 0) {
+                    std::printf("skip job %s: source device of %s is in use by another job\n", job.name.c_str(), job.source.c_str());
+                }
+                mount_session_release(job.mount, mode);
+                lock_release(&job_lock);
+                return 1;
+            }
+        }
+    }
+
+    double t = phase_begin("verify");
+    bool verified = verify_destination(job, cfg.mount_prefix, &err);
+    phase_end("verify", t);
+    if (!verified) {
+        std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
+        lock_release(&source_lock);
+        mount_session_release(job.mount, mode);
+        lock_release(&job_lock);
+        return 1;
+    }
+
+    t = phase_begin("expire");
+    expire_old_backups(job, job.dest, mode, job_metrics);
+    phase_end("expire", t);
+
+    std::string current_path = job.dest + "/current";
+    std::string backup_dir = job.dest + "/" + backup_day;
+    struct stat st;
+    if (stat(current_path.c_str(), &st) == 0 && access(backup_dir.c_str(), F_OK) != 0) {
+        t = phase_begin("clone");
+        if (mode.dry_run) {
+            std::printf("dry-run: mkdir -p %s\n", backup_dir.c_str());
+        } else {
+            mkdir(backup_dir.c_str(), 0755);
+        }
+        std::string cp_src = current_path + "/.";
+        run_nice_ionice({"cp", "-ralf", cp_src, backup_dir}, mode);
+        phase_end("clone", t);
+        if (mode.safe_mode || mode.dry_run) {
+            if (mode.dry_run) {
+                std::printf("dry-run: find %s -type l -delete\n", backup_dir.c_str());
+            } else {
+                std::printf("skip symlink cleanup (safe-mode): %s\n", backup_dir.c_str());
+            }
+        } else {
+            t = phase_begin("symlink cleanup");
+            delete_symlinks(backup_dir);
+            phase_end("symlink cleanup", t);
+        }
+    }
+
+    std::vector<std::string> rsync_args = {"rsync", "-ar", "--stats", std::string("--exclude-from=") + excludes_path};
+    if (!mode.safe_mode) {
+        rsync_args.push_back("--delete-after");
+        rsync_args.push_back("--delete-excluded");
+    }
+    for (const auto &arg : rsync_extra) rsync_args.push_back(arg);
+    rsync_args.push_back(job.source);
+    rsync_args.push_back(backup_dir);
+
+    static const char *rsync_phases[] = {"rsync 1/3", "rsync 2/3", "rsync 3/3"};
+    int rc = 1;
+    for (int i = 0; i < 3; i++) {
+        if (job_cancelled(job.name)) {
+            std::printf("job %s cancelled\n", job.name.c_str());
+            rc = 1;
+            break;
+        }
+        t = phase_begin(rsync_phases[i]);
+        std::string output;
+        rc = run_nice_ionice(rsync_args, mode, &output);
+        phase_end(rsync_phases[i], t);
+        job_metrics->rsync_codes.push_back(rc);
+        RsyncStats stats = parse_rsync_stats(output);
+        if (stats.files_transferred >= 0) {
+            job_metrics->files_transferred = std::max(job_metrics->files_transferred, 0LL) + stats.files_transferred;
+        }
+        if (stats.bytes_transferred >= 0) {
+            job_metrics->bytes_transferred = std::max(job_metrics->bytes_transferred, 0LL) + stats.bytes_transferred;
+        }
+    }
+
+    if (rc == 0 && access(backup_dir.c_str(), F_OK) == 0) {
+        t = phase_begin("current");
+        std::string current_link = job.dest + "/current";
+        struct stat lstat_buf;
+        if (lstat(current_link.c_str(), &lstat_buf) == 0) {
+            if (S_ISLNK(lstat_buf.st_mode) || S_ISREG(lstat_buf.st_mode)) {
+                if (mode.safe_mode || mode.dry_run) {
+                    if (mode.dry_run) {
+                        std::printf("dry-run: rm -f %s\n", current_link.c_str());
+                    } else {
+                        std::printf("skip remove (safe-mode): %s\n", current_link.c_str());
+                    }
+                } else {
+                    unlink(current_link.c_str());
+                }
+            } else if (S_ISDIR(lstat_buf.st_mode)) {
+                std::printf("skip updating current (directory exists): %s\n", current_link.c_str());
+            }
+        }
+        if (access(current_link.c_str(), F_OK) != 0) {
+            if (mode.dry_run) {
+                std::printf("dry-run: ln -s %s %s\n", backup_day, current_link.c_str());
+            } else {
+                symlink(backup_day, current_link.c_str());
+            }
+        }
+        phase_end("current", t);
+        if (cfg.manifests && !mode.dry_run) {
+            t = phase_begin("manifest");
+            std::vector<std::string> snapshots;
+            std::string previous;
+            if (list_snapshots(job.dest, &snapshots)) {
+                for (const auto &name : snapshots) {
+                    if (name < backup_day && name > previous) previous = name;
+                }
+            }
+            if (!write_snapshot_manifest(job.dest, backup_day, previous, cfg.manifest_hashes, &err)) {
+                std::printf("job %s: manifest not written: %s\n", job.name.c_str(), err.c_str());
+            }
+            phase_end("manifest", t);
+        }
+        // The catalog feeds the unique-bytes gauges, so it is kept whenever
+        // they are exported; without manifests it walks the recounted
+        // snapshots instead.
+        if ((cfg.manifests || !cfg.prometheus_textfile.empty()) && !mode.dry_run) {
+            t = phase_begin("catalog");
+            std::vector<SnapshotUsage> usage;
+            if (!update_snapshot_catalog(job.dest, false, &usage, &err)) {
+                std::printf("job %s: catalog not updated: %s\n", job.name.c_str(), err.c_str());
+            } else {
+                for (const auto &u : usage) {
+                    job_metrics->snapshot_unique_bytes[u.name] = static_cast<long long>(u.unique_bytes);
+                }
+            }
+            phase_end("catalog", t);
+        }
+    }
+
+    if (!mode.dry_run && mount_is_mounted(job.mount)) {
+        std::vector<std::string> backups;
+        if (list_snapshots(job.dest, &backups)) {
+            job_metrics->snapshots = static_cast<int>(backups.size());
+        }
+        struct statvfs vfs;
+        if (statvfs(job.mount.c_str(), &vfs) == 0) {
+            job_metrics->disk_used_bytes = static_cast<long long>((vfs.f_blocks - vfs.f_bfree) * vfs.f_frsize);
+            job_metrics->disk_free_bytes = static_cast<long long>(vfs.f_bavail * vfs.f_frsize);
+        }
+    }
+
+    lock_release(&source_lock);
+    mount_session_release(job.mount, mode);
+    lock_release(&job_lock);
+    return rc == 0 ? 0 : 1;
+}
+
+struct HistoryRecord {
+    long long finished = 0;
+    double duration_sec = 0.0;
+    long long bytes = -1;
+    int rc = 0;
+};
+
+struct JobHistory {
+    std::unordered_map<std::string, std::vector<HistoryRecord>> runs;
+    size_t records = 0;
+};
+
+static const size_t HISTORY_KEEP = 8;
+static const size_t HISTORY_ESTIMATE_RUNS = 5;
+static const double DEFAULT_JOB_ESTIMATE_SEC = 600.0;
+
+static void load_job_history(const std::string &path, JobHistory *history) {
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (!f) return;
+    char line[512];
+    while (std::fgets(line, sizeof(line), f)) {
+        char name[256];
+        HistoryRecord rec;
+        if (std::sscanf(line, "%255s %lld %lf %lld %d", name, &rec.finished, &rec.duration_sec, &rec.bytes, &rec.rc) != 5) {
+            continue;
+        }
+        history->runs[name].push_back(rec);
+        history->records++;
+    }
+    std::fclose(f);
+    for (auto &entry : history->runs) {
+        std::vector<HistoryRecord> &runs = entry.second;
+        if (runs.size() > HISTORY_KEEP) {
+            runs.erase(runs.begin(), runs.end() - static_cast<long>(HISTORY_KEEP));
+        }
+    }
+}
+
+static bool write_history_record(FILE *f, const std::string &name, const HistoryRecord &rec) {
+    return std::fprintf(f, "%s %lld %.3f %lld %d\n", name.c_str(), rec.finished, rec.duration_sec, rec.bytes, rec.rc) > 0;
+}
+
+// The file is append-only between compactions; appends and the rewrite both
+// hold <history>.lock so records from concurrent runs are not lost.
+static void append_job_history(const std::string &path, const std::string &name, const HistoryRecord &rec) {
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    FileLock lock;
+    if (lock_acquire(path + ".lock", 10, &lock, nullptr) != 1) return;
+    FILE *f = std::fopen(path.c_str(), "a");
+    if (f) {
+        write_history_record(f, name, rec);
+        std::fclose(f);
+    }
+    lock_release(&lock);
+}
+
+static bool compact_job_history(const std::string &path, const JobHistory &history) {
+    if (history.records <= HISTORY_KEEP * history.runs.size() * 2 + 64) return false;
+    FileLock lock;
+    if (lock_acquire(path + ".lock", 0, &lock, nullptr) != 1) return false;
+    bool compacted = false;
+    JobHistory current;
+    load_job_history(path, &current);
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (f) {
+        bool ok = true;
+        for (const auto &entry : current.runs) {
+            for (const auto &rec : entry.second) {
+                ok = write_history_record(f, entry.first, rec) && ok;
+            }
+        }
+        ok = std::fclose(f) == 0 && ok;
+        compacted = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+        if (!compacted) {
+            ::unlink(tmp.c_str());
+        }
+    }
+    lock_release(&lock);
+    return compacted;
+}
+
+static bool history_estimate(const JobHistory &history, const std::string &name, double *duration, long long *bytes) {
+    auto it = history.runs.find(name);
+    if (it == history.runs.end()) return false;
+    double total = 0.0;
+    size_t count = 0;
+    for (auto rec = it->second.rbegin(); rec != it->second.rend() && count < HISTORY_ESTIMATE_RUNS; ++rec) {
+        if (rec->rc != 0) continue;
+        total += rec->duration_sec;
+        if (count == 0 && bytes) *bytes = rec->bytes;
+        count++;
+    }
+    if (count == 0) return false;
+    *duration = total / static_cast<double>(count);
+    return true;
+}
+
+static std::string format_duration(double sec) {
+    long long total = static_cast<long long>(sec + 0.5);
+    char buf[64];
+    if (total >= 3600) {
+        std::snprintf(buf, sizeof(buf), "%lldh%02lldm%02llds", total / 3600, (total / 60) % 60, total % 60);
+    } else if (total >= 60) {
+        std::snprintf(buf, sizeof(buf), "%lldm%02llds", total / 60, total % 60);
+    } else {
+        std::snprintf(buf, sizeof(buf), "%.1fs", sec);
+    }
+    return buf;
+}
+
+enum class JobState {
+    Pending,
+    Ready,
+    Running,
+    Succeeded,
+    Failed,
+    Cancelled
+};
+
+struct JobNode {
+    std::vector<int> dependents;
+    std::vector<int> resources;
+    int remaining = 0;
+    JobState state = JobState::Pending;
+    int rc = 0;
+    double estimate_sec = 0.0;
+    bool estimate_known = false;
+    long long last_bytes = -1;
+    double priority = 0.0;
+};
+
+struct JobPlan {
+    std::vector<JobNode> nodes;
+    std::vector<ResourceUsage> resources;
+    ConcurrencyLimits limits;
+};
+
+static void add_job_resource(
+    const std::string &name,
+    int limit,
+    std::unordered_map<std::string, int> *index,
+    std::vector<ResourceUsage> *resources,
+    JobNode *node
+) {
+    auto it = index->find(name);
+    int res = 0;
+    if (it == index->end()) {
+        res = static_cast<int>(resources->size());
+        index->emplace(name, res);
+        ResourceUsage usage;
+        usage.name = name;
+        usage.limit = limit;
+        resources->push_back(usage);
+    } else {
+        res = it->second;
+    }
+    node->resources.push_back(res);
+}
+
+static ConcurrencyLimits effective_limits(const Config &cfg, int max_parallel, bool warn) {
+    ConcurrencyLimits limits = cfg.limits;
+    if (max_parallel > 0) limits.jobs = max_parallel;
+    if (cfg.lock_source_device && limits.per_source != 1) {
+        if (warn) std::printf("concurrency.per_source %d conflicts with lock_source_device; using 1\n", limits.per_source);
+        limits.per_source = 1;
+    }
+    return limits;
+}
+
+// jobs must be in dependency order (topo_sort_jobs), so every dependent sits
+// after its dependencies and the critical path can be summed back to front.
+static void build_job_plan(
+    const std::vector<Job> &jobs,
+    const ConcurrencyLimits &limits,
+    const JobHistory &history,
+    SchedulePolicy policy,
+    JobPlan *plan
+) {
+    plan->limits = limits;
+    plan->nodes.assign(jobs.size(), JobNode());
+    plan->resources.clear();
+    std::vector<JobNode> &nodes = plan->nodes;
+    std::unordered_map<std::string, int> positions;
+    std::unordered_map<std::string, int> resource_index;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        positions[jobs[i].name] = static_cast<int>(i);
+    }
+    std::vector<double> known;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        for (const auto &dep : jobs[i].depends_on) {
+            auto it = positions.find(dep);
+            if (it == positions.end()) continue;
+            std::vector<int> &dependents = nodes[it->second].dependents;
+            if (std::find(dependents.begin(), dependents.end(), static_cast<int>(i)) != dependents.end()) continue;
+            dependents.push_back(static_cast<int>(i));
+            nodes[i].remaining++;
+        }
+        std::string id;
+        add_job_resource("disk:" + jobs[i].mount, limits.per_disk, &resource_index, &plan->resources, &nodes[i]);
+        if (source_device_id(jobs[i].source, &id)) {
+            add_job_resource("source:" + id, limits.per_source, &resource_index, &plan->resources, &nodes[i]);
+        } else if (source_host(jobs[i].source, &id)) {
+            add_job_resource("host:" + id, limits.per_host, &resource_index, &plan->resources, &nodes[i]);
+        }
+        nodes[i].estimate_known = history_estimate(history, jobs[i].name, &nodes[i].estimate_sec, &nodes[i].last_bytes);
+        if (nodes[i].estimate_known) known.push_back(nodes[i].estimate_sec);
+    }
+    double fallback = DEFAULT_JOB_ESTIMATE_SEC;
+    if (!known.empty()) {
+        std::nth_element(known.begin(), known.begin() + static_cast<long>(known.size() / 2), known.end());
+        fallback = known[known.size() / 2];
+    }
+    for (size_t i = jobs.size(); i-- > 0;) {
+        JobNode &node = nodes[i];
+        if (!node.estimate_known) node.estimate_sec = fallback;
+        switch (policy) {
+            case SchedulePolicy::CriticalPath: {
+                double tail = 0.0;
+                for (int dep : node.dependents) tail = std::max(tail, nodes[dep].priority);
+                node.priority = node.estimate_sec + tail;
+                break;
+            }
+            case SchedulePolicy::LongestFirst:
+                node.priority = node.estimate_sec;
+                break;
+            case SchedulePolicy::ConfigOrder:
+                node.priority = -static_cast<double>(i);
+                break;
+        }
+    }
+}
+
+static bool plan_runnable(const JobPlan &plan, int idx) {
+    for (int res : plan.nodes[idx].resources) {
+        const ResourceUsage &usage = plan.resources[res];
+        if (usage.limit > 0 && usage.in_use >= usage.limit) return false;
+    }
+    return true;
+}
+
+static void plan_claim(JobPlan *plan, int idx) {
+    plan->nodes[idx].state = JobState::Running;
+    for (int res : plan->nodes[idx].resources) {
+        ResourceUsage &usage = plan->resources[res];
+        usage.in_use++;
+        usage.peak = std::max(usage.peak, usage.in_use);
+    }
+}
+
+// Highest priority runnable job in the queue; ties go to a job on
+// last_disk (the disk the caller just used), then to dependency order.
+static int plan_take(const JobPlan &plan, std::deque<int> *queue, int last_disk) {
+    auto better = [&](int a, int b) {
+        const JobNode &na = plan.nodes[a];
+        const JobNode &nb = plan.nodes[b];
+        if (na.priority != nb.priority) return na.priority > nb.priority;
+        bool a_same = na.resources[0] == last_disk;
+        bool b_same = nb.resources[0] == last_disk;
+        if (a_same != b_same) return a_same;
+        return a < b;
+    };
+    auto best = queue->end();
+    for (auto it = queue->begin(); it != queue->end(); ++it) {
+        if (!plan_runnable(plan, *it)) continue;
+        if (best == queue->end() || better(*it, *best)) best = it;
+    }
+    if (best == queue->end()) return -1;
+    int idx = *best;
+    queue->erase(best);
+    return idx;
+}
+
+struct SchedulePrediction {
+    std::vector<int> order;
+    std::vector<double> start;
+    double makespan = 0.0;
+    double critical_path = 0.0;
+    double serial = 0.0;
+};
+
+// List-schedules the plan on its estimates with the same priority and
+// resource rules as backup_jobs, assuming every job succeeds.
+static SchedulePrediction predict_schedule(JobPlan plan) {
+    SchedulePrediction out;
+    size_t count = plan.nodes.size();
+    out.start.assign(count, 0.0);
+    std::vector<double> path(count, 0.0);
+    std::deque<int> ready;
+    for (size_t i = 0; i < count; i++) {
+        out.serial += plan.nodes[i].estimate_sec;
+        if (plan.nodes[i].remaining == 0) ready.push_back(static_cast<int>(i));
+    }
+    std::vector<std::pair<double, int>> running;
+    int workers = std::max(1, plan.limits.jobs);
+    double now = 0.0;
+    int last_disk = -1;
+    while (out.order.size() < count) {
+        while (static_cast<int>(running.size()) < workers) {
+            int idx = plan_take(plan, &ready, last_disk);
+            if (idx < 0) break;
+            last_disk = plan.nodes[idx].resources[0];
+            plan_claim(&plan, idx);
+            out.order.push_back(idx);
+            out.start[idx] = now;
+            running.emplace_back(now + plan.nodes[idx].estimate_sec, idx);
+        }
+        if (running.empty()) break;
+        auto next = std::min_element(running.begin(), running.end());
+        now = next->first;
+        int idx = next->second;
+        running.erase(next);
+        for (int res : plan.nodes[idx].resources) plan.resources[res].in_use--;
+        out.makespan = std::max(out.makespan, now);
+        for (int dep : plan.nodes[idx].dependents) {
+            path[dep] = std::max(path[dep], path[idx] + plan.nodes[idx].estimate_sec);
+            if (--plan.nodes[dep].remaining == 0) ready.push_back(dep);
+        }
+        out.critical_path = std::max(out.critical_path, path[idx] + plan.nodes[idx].estimate_sec);
+    }
+    return out;
+}
+
+static void print_predicted_order(const std::vector<Job> &jobs, const Config &cfg, const JobPlan &plan) {
+    SchedulePrediction prediction = predict_schedule(plan);
+    for (int idx : prediction.order) {
+        const JobNode &node = plan.nodes[idx];
+        print_job_details(jobs[idx], cfg);
+        std::printf("  estimate: %s (%s)\n", format_duration(node.estimate_sec).c_str(), node.estimate_known ? "history" : "default");
+        if (node.last_bytes >= 0) {
+            std::printf("  last transfer: %lld bytes\n", node.last_bytes);
+        }
+        std::printf("  predicted start: +%s\n", format_duration(prediction.start[idx]).c_str());
+    }
+    std::printf("predicted makespan: %s with %d worker(s) (critical path %s, serial %s)\n",
+        format_duration(prediction.makespan).c_str(),
+        std::max(1, plan.limits.jobs),
+        format_duration(prediction.critical_path).c_str(),
+        format_duration(prediction.serial).c_str());
+}
+
+// Runs jobs (already in dependency order) as a DAG on a pool of workers. A
+// job becomes ready when its dependencies succeed and is queued on the worker
+// that finished the last one; it only starts while every resource it touches
+// (target disk, source device, source host) has a free slot. Workers take
+// their highest priority runnable job (see build_job_plan) and steal from
+// another worker's queue when they have none. A failed job cancels its
+// dependents only.
+static int backup_jobs(
+    const std::vector<Job> &jobs,
+    const std::vector<std::string> &rsync_extra,
+    const RunMode &mode,
+    const Config &cfg,
+    JobPlan plan,
+    JobHistory *history,
+    RunMetrics *metrics
+) {
+    std::vector<JobNode> &nodes = plan.nodes;
+    mount_session_opens = 0;
+    metrics->jobs.assign(jobs.size(), JobMetrics());
+    metrics->limits = plan.limits;
+    metrics->workers = std::min(plan.limits.jobs, static_cast<int>(jobs.size()));
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<std::deque<int>> queues(static_cast<size_t>(std::max(metrics->workers, 1)));
+    size_t unfinished = jobs.size();
+    std::vector<int> start_order;
+    std::vector<std::string> exclude_paths(cfg.exclude_sets.size());
+    std::vector<char> exclude_ready(cfg.exclude_sets.size(), 0);
+    for (const auto &job : jobs) {
+        mount_session_expect(job.mount);
+        if (exclude_ready[job.exclude_set]) continue;
+        exclude_ready[job.exclude_set] = 1;
+        std::string &path = exclude_paths[job.exclude_set];
+        if (!prepare_excludes_file(cfg.exclude_sets[job.exclude_set], cfg.runtime_dir, mode, &path)) {
+            std::printf("cannot write excludes file %s: %s\n", path.c_str(), std::strerror(errno));
+            path.clear();
+        }
+    }
+    metrics->started = monotonic_seconds();
+    metrics->started_at = static_cast<long long>(std::time(nullptr));
+    {
+        std::lock_guard<std::mutex> guard(job_status_mutex);
+        job_status.clear();
+        run_spans.clear();
+        run_started = metrics->started;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            JobStatus &status = job_status[jobs[i].name];
+            status.state = "pending";
+            status.estimate_sec = nodes[i].estimate_known ? nodes[i].estimate_sec : 0.0;
+        }
+    }
+    size_t next_queue = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (nodes[i].remaining != 0) continue;
+        nodes[i].state = JobState::Ready;
+        job_status_set(jobs[i].name, "ready");
+        queues[next_queue++ % queues.size()].push_back(static_cast<int>(i));
+    }
+
+    auto worker = [&](size_t self) {
+        trace_thread_name(self == 0 ? std::string("main") : "worker " + std::to_string(self));
+        std::unique_lock<std::mutex> guard(mu);
+        int last_disk = -1;
+        for (;;) {
+            if (unfinished == 0) break;
+            int idx = plan_take(plan, &queues[self], last_disk);
+            for (size_t k = 1; idx < 0 && k < queues.size(); k++) {
+                idx = plan_take(plan, &queues[(self + k) % queues.size()], last_disk);
+                if (idx >= 0) metrics->steals++;
+            }
+            if (idx < 0) {
+                cv.wait(guard);
+                continue;
+            }
+            JobNode &node = nodes[idx];
+            plan_claim(&plan, idx);
+            start_order.push_back(idx);
+            last_disk = node.resources[0];
+            guard.unlock();
+            JobMetrics &job_metrics = metrics->jobs[idx];
+            double started = monotonic_seconds();
+            {
+                std::lock_guard<std::mutex> status_guard(job_status_mutex);
+                JobStatus &status = job_status[jobs[idx].name];
+                status.state = "running";
+                status.started = started;
+            }
+            bool cancelled = job_cancelled(jobs[idx].name);
+            int rc = 1;
+            if (cancelled) {
+                std::printf("skip job %s: cancelled\n", jobs[idx].name.c_str());
+            } else {
+                active_job = jobs[idx].name;
+                rc = backup_job(jobs[idx], rsync_extra, mode, cfg, exclude_paths[jobs[idx].exclude_set], &job_metrics);
+                cancelled = job_cancelled(jobs[idx].name);
+            }
+            job_metrics.duration_sec = monotonic_seconds() - started;
+            job_metrics.exit_code = rc;
+            trace_event(jobs[idx].name, "job", started, {{"exit", std::to_string(rc)}, {"mount", jobs[idx].mount}});
+            job_status_set(jobs[idx].name, cancelled ? "cancelled" : (rc == 0 ? "succeeded" : "failed"));
+            HistoryRecord rec;
+            rec.finished = static_cast<long long>(std::time(nullptr));
+            rec.duration_sec = job_metrics.duration_sec;
+            rec.bytes = job_metrics.bytes_transferred;
+            rec.rc = rc;
+            bool record = !mode.dry_run && rc != 3 && !cancelled;
+            if (record) {
+                append_job_history(cfg.history_path, jobs[idx].name, rec);
+            }
+            mount_session_finish(jobs[idx].mount, mode);
+            active_job.clear();
+            if (!mode.dry_run && !cfg.prometheus_textfile.empty()) {
+                const char *result = cancelled ? "cancelled" : (rc == 0 ? "success" : "failure");
+                export_job_metrics(cfg.prometheus_textfile, jobs[idx], job_metrics, result);
+            }
+            guard.lock();
+
+            if (record) {
+                std::vector<HistoryRecord> &runs = history->runs[jobs[idx].name];
+                runs.push_back(rec);
+                if (runs.size() > HISTORY_KEEP) runs.erase(runs.begin());
+                history->records++;
+            }
+
+            for (int res : node.resources) plan.resources[res].in_use--;
+            node.rc = rc;
+            node.state = cancelled ? JobState::Cancelled : (rc == 0 ? JobState::Succeeded : JobState::Failed);
+            unfinished--;
+            if (node.state == JobState::Succeeded) {
+                for (int dep : node.dependents) {
+                    if (--nodes[dep].remaining == 0 && nodes[dep].state == JobState::Pending) {
+                        nodes[dep].state = JobState::Ready;
+                        job_status_set(jobs[dep].name, "ready");
+                        queues[self].push_back(dep);
+                    }
+                }
+            } else {
+                std::vector<int> stack = node.dependents;
+                std::vector<std::string> finished_mounts;
+                while (!stack.empty()) {
+                    int dep = stack.back();
+                    stack.pop_back();
+                    if (nodes[dep].state != JobState::Pending) continue;
+                    nodes[dep].state = JobState::Cancelled;
+                    job_status_set(jobs[dep].name, "cancelled");
+                    unfinished--;
+                    finished_mounts.push_back(jobs[dep].mount);
+                    std::printf("skip job %s: dependency %s %s\n", jobs[dep].name.c_str(), jobs[idx].name.c_str(),
+                        cancelled ? "was cancelled" : "failed");
+                    stack.insert(stack.end(), nodes[dep].dependents.begin(), nodes[dep].dependents.end());
+                }
+                // Closing a session remounts and unmounts; not under mu.
+                if (!finished_mounts.empty()) {
+                    cv.notify_all();
+                    guard.unlock();
+                    for (const auto &mount : finished_mounts) mount_session_finish(mount, mode);
+                    guard.lock();
+                }
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < queues.size(); w++) {
+        threads.emplace_back(worker, w);
+    }
+    worker(0);
+    for (auto &t : threads) t.join();
+    mount_sessions_close_all(mode);
+    metrics->mount_cycles = mount_session_opens;
+    // jobs arrive in dependency order, the order runs had before affinity.
+    std::vector<int> dependency_order(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) dependency_order[i] = static_cast<int>(i);
+    metrics->mount_transitions = count_mount_transitions(jobs, start_order);
+    metrics->baseline_transitions = count_mount_transitions(jobs, dependency_order);
+
+    std::vector<ResourceUsage> resources = plan.resources;
+    std::sort(resources.begin(), resources.end(), [](const ResourceUsage &a, const ResourceUsage &b) {
+        return a.name < b.name;
+    });
+    metrics->resources = resources;
+    int exit_code = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        metrics->jobs[i].name = jobs[i].name;
+        metrics->lock_wait_sec += metrics->jobs[i].lock_wait_sec;
+        if (nodes[i].state == JobState::Failed && (nodes[i].rc == 2 || nodes[i].rc == 3)) {
+            exit_code = std::max(exit_code, nodes[i].rc);
+        }
+    }
+    return exit_code;
+}
+
+struct DaemonConfig {
+    Config cfg;
+    JobGraph graph;
+    std::vector<int> order;
+    std::vector<CronSpec> schedules;
+};
+
+static bool daemon_load_config(const std::string &path, const RunMode &mode, bool use_cache, DaemonConfig *out, std::string *err) {
+    DaemonConfig loaded;
+    double started = monotonic_seconds();
+    if (!load_config(path, mode, use_cache, &loaded.cfg, &loaded.graph, &loaded.order, err)) {
+        return false;
+    }
+    trace_event("load config", "config", started, {{"path", path}});
+    loaded.schedules.resize(loaded.cfg.jobs.size());
+    for (size_t i = 0; i < loaded.cfg.jobs.size(); i++) {
+        const Job &job = loaded.cfg.jobs[i];
+        if (!job.schedule.empty() && !parse_cron(job.schedule, &loaded.schedules[i])) {
+            *err = "job " + job.name + ": invalid schedule " + job.schedule;
+            return false;
+        }
+    }
+    *out = std::move(loaded);
+    return true;
+}
+
+// Drains pending inotify events; true when one names the config file.
+static bool config_file_changed(int fd, const std::string &name) {
+    alignas(struct inotify_event) char buf[4096];
+    bool changed = false;
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (ssize_t off = 0; off < n;) {
+            const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(buf + off);
+            if (ev->len > 0 && name == ev->name) changed = true;
+            off += static_cast<ssize_t>(sizeof(struct inotify_event) + ev->len);
+        }
+    }
+    return changed;
+}
+
+static int daemon_run_jobs(
+    const DaemonConfig &state,
+    const std::vector<std::string> &roots,
+    const std::vector<std::string> &rsync_extra,
+    const RunMode &mode,
+    int max_parallel,
+    const RunOutputs &outputs,
+    const char *label,
+    JobHistory *history
+) {
+    const Config &cfg = state.cfg;
+    std::vector<int> included(cfg.jobs.size(), 0);
+    std::vector<int> order;
+    std::string err;
+    if (!collect_jobs_with_deps(cfg, state.graph, roots, &included, &err) ||
+        !topo_sort_jobs(cfg, state.graph, included, true, &order, &err)) {
+        std::printf("skipping %s: %s\n", label, err.c_str());
+        return 2;
+    }
+    std::vector<Job> jobs;
+    for (int idx : order) {
+        jobs.push_back(cfg.jobs[idx]);
+    }
+    char timebuf[64];
+    format_time(timebuf, sizeof(timebuf), std::time(nullptr));
+    std::printf("%s\n", timebuf);
+    std::printf("%s: %zu job(s)\n", label, jobs.size());
+    JobPlan plan;
+    build_job_plan(jobs, effective_limits(cfg, max_parallel, mode.verbose), *history, mode.schedule, &plan);
+    RunMetrics metrics;
+    daemon_busy = true;
+    int exit_code = backup_jobs(jobs, rsync_extra, mode, cfg, plan, history, &metrics);
+    if (!mode.dry_run) {
+        if (compact_job_history(cfg.history_path, *history)) {
+            history->records = 0;
+            for (const auto &entry : history->runs) history->records += entry.second.size();
+        }
+        double t = phase_begin("sync");
+        run_command({"sync"}, mode);
+        phase_end("sync", t);
+    }
+    daemon_busy = false;
+    collect_job_status(&metrics);
+    print_run_metrics(metrics, mode);
+    if (executor.mode == ExecutorMode::Replay) {
+        std::printf("replay: %ld exact, %ld by shape, %ld unmatched\n", executor.exact, executor.shaped, executor.missed);
+    }
+    write_run_outputs(outputs, metrics, exit_code, mode);
+    format_time(timebuf, sizeof(timebuf), std::time(nullptr));
+    std::printf("%s\n", timebuf);
+    std::fflush(stdout);
+    return exit_code;
+}
+
+static const uint32_t CONTROL_MAX_FRAME = 1 << 20;
+
+static std::string control_socket_path(const Config &cfg) {
+    return cfg.runtime_dir + "/control.sock";
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::read(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// A frame is a 4-byte big-endian length followed by the payload. Requests
+// are the command and its arguments, one per line; replies start with "ok"
+// or "error: <reason>" and carry any output on the following lines.
+static bool write_frame(int fd, const std::string &payload) {
+    uint32_t len = static_cast<uint32_t>(payload.size());
+    unsigned char head[4] = {
+        static_cast<unsigned char>(len >> 24), static_cast<unsigned char>(len >> 16),
+        static_cast<unsigned char>(len >> 8), static_cast<unsigned char>(len)};
+    return write_all(fd, reinterpret_cast<const char *>(head), sizeof(head)) && write_all(fd, payload.data(), payload.size());
+}
+
+static bool read_frame(int fd, std::string *payload) {
+    unsigned char head[4];
+    if (!read_all(fd, reinterpret_cast<char *>(head), sizeof(head))) return false;
+    uint32_t len = (static_cast<uint32_t>(head[0]) << 24) | (static_cast<uint32_t>(head[1]) << 16) |
+        (static_cast<uint32_t>(head[2]) << 8) | head[3];
+    if (len > CONTROL_MAX_FRAME) return false;
+    payload->assign(len, '\0');
+    return len == 0 || read_all(fd, &(*payload)[0], len);
+}
+
+static std::vector<std::string> split_lines(const std::string &text) {
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) end = text.size();
+        lines.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+struct DemandRequest {
+    std::vector<std::string> roots;
+    std::vector<std::string> jobs;
+};
+
+struct DaemonControl {
+    std::mutex mu;
+    const DaemonConfig *state = nullptr;
+    std::vector<DemandRequest> queue;
+    int wake_fd = -1;
+    std::atomic<bool> stop{false};
+};
+
+static std::string join_names(const std::vector<std::string> &names) {
+    std::string out;
+    for (const auto &name : names) {
+        if (!out.empty()) out += ' ';
+        out += name;
+    }
+    return out;
+}
+
+static std::string control_enqueue(DaemonControl *ctl, const std::vector<std::string> &names) {
+    if (names.empty()) return "error: enqueue requires job names";
+    std::lock_guard<std::mutex> guard(ctl->mu);
+    const DaemonConfig &state = *ctl->state;
+    std::vector<int> included(state.cfg.jobs.size(), 0);
+    std::string err;
+    if (!collect_jobs_with_deps(state.cfg, state.graph, names, &included, &err)) {
+        return "error: " + err;
+    }
+    DemandRequest req;
+    req.roots = names;
+    for (int idx : state.order) {
+        if (included[idx]) req.jobs.push_back(state.cfg.jobs[idx].name);
+    }
+    std::string reply = "ok\nqueued " + join_names(req.jobs);
+    ctl->queue.push_back(std::move(req));
+    char byte = 1;
+    if (::write(ctl->wake_fd, &byte, 1) < 0) {
+        // The pipe is full, so the main loop already has a wakeup pending.
+    }
+    return reply;
+}
+
+static std::string control_list(DaemonControl *ctl) {
+    std::string reply = "ok";
+    {
+        std::lock_guard<std::mutex> guard(job_status_mutex);
+        for (const auto &entry : job_status) {
+            reply += "\nrun " + entry.first + " " + entry.second.state;
+        }
+    }
+    std::lock_guard<std::mutex> guard(ctl->mu);
+    for (size_t i = 0; i < ctl->queue.size(); i++) {
+        reply += "\nqueued " + std::to_string(i + 1) + ": " + join_names(ctl->queue[i].jobs) +
+            " (requested: " + join_names(ctl->queue[i].roots) + ")";
+    }
+    return reply;
+}
+
+// One tab-separated line per span: job ("-" for the run), phase, start
+// offset from the start of the run and duration, both in seconds.
+static std::string control_timings() {
+    std::string reply = "ok";
+    char buf[64];
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    for (const auto &entry : job_status) {
+        for (const auto &span : entry.second.spans) {
+            std::snprintf(buf, sizeof(buf), "\t%.3f\t%.3f", span.start_sec - run_started, span.duration_sec);
+            reply += "\n" + entry.first + "\t" + span.name + buf;
+        }
+    }
+    for (const auto &span : run_spans) {
+        std::snprintf(buf, sizeof(buf), "\t%.3f\t%.3f", span.start_sec - run_started, span.duration_sec);
+        reply += "\n-\t" + span.name + buf;
+    }
+    return reply;
+}
+
+static std::string control_status() {
+    std::string reply = "ok";
+    double now = monotonic_seconds();
+    std::lock_guard<std::mutex> guard(job_status_mutex);
+    for (const auto &entry : job_status) {
+        const JobStatus &status = entry.second;
+        reply += "\n" + entry.first + " " + status.state;
+        if (status.state != "running") continue;
+        double elapsed = now - status.started;
+        reply += " " + (status.phase.empty() ? std::string("starting") : status.phase) + " " + format_duration(elapsed);
+        if (status.estimate_sec > 0.0) {
+            int percent = static_cast<int>(std::min(99.0, 100.0 * elapsed / status.estimate_sec));
+            reply += " of ~" + format_duration(status.estimate_sec) + " (" + std::to_string(percent) + "%)";
+        }
+        if (status.cancel) reply += " cancelling";
+    }
+    return reply;
+}
+
+// Queued jobs are dropped from the queue; jobs in the current run are
+// skipped if they have not started, and a running job's child process is
+// terminated and its remaining rsync passes are skipped.
+static std::string control_cancel(DaemonControl *ctl, const std::vector<std::string> &names) {
+    if (names.empty()) return "error: cancel requires job names";
+    std::string reply = "ok";
+    for (const auto &name : names) {
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> guard(ctl->mu);
+            bool dependency = false;
+            for (auto it = ctl->queue.begin(); it != ctl->queue.end();) {
+                auto root = std::find(it->roots.begin(), it->roots.end(), name);
+                if (root == it->roots.end()) {
+                    if (std::find(it->jobs.begin(), it->jobs.end(), name) != it->jobs.end()) dependency = true;
+                    ++it;
+                    continue;
+                }
+                it->roots.erase(root);
+                done = true;
+                if (it->roots.empty()) {
+                    it = ctl->queue.erase(it);
+                    continue;
+                }
+                const DaemonConfig &state = *ctl->state;
+                std::vector<int> included(state.cfg.jobs.size(), 0);
+                std::string err;
+                collect_jobs_with_deps(state.cfg, state.graph, it->roots, &included, &err);
+                it->jobs.clear();
+                for (int idx : state.order) {
+                    if (included[idx]) it->jobs.push_back(state.cfg.jobs[idx].name);
+                }
+                ++it;
+            }
+            if (done) {
+                reply += "\nremoved " + name + " from the queue";
+                continue;
+            }
+            if (dependency) {
+                reply += "\n" + name + " is a dependency of a queued job; cancel that job instead";
+                continue;
+            }
+        }
+        std::lock_guard<std::mutex> guard(job_status_mutex);
+        auto it = job_status.find(name);
+        if (it == job_status.end() ||
+            (it->second.state != "pending" && it->second.state != "ready" && it->second.state != "running")) {
+            reply += "\n" + name + " is not queued or running";
+            continue;
+        }
+        it->second.cancel = true;
+        if (it->second.child > 0) kill(it->second.child, SIGTERM);
+        reply += "\ncancelling " + name;
+    }
+    return reply;
+}
+
+static std::string control_handle(DaemonControl *ctl, const std::string &request) {
+    std::vector<std::string> args = split_lines(request);
+    if (args.empty()) return "error: empty request";
+    std::string command = args[0];
+    args.erase(args.begin());
+    if (command == "enqueue") return control_enqueue(ctl, args);
+    if (command == "list") return control_list(ctl);
+    if (command == "status") return control_status();
+    if (command == "timings") return control_timings();
+    if (command == "cancel") return control_cancel(ctl, args);
+    return "error: unknown command " + command + " (use enqueue, list, status, timings or cancel)";
+}
+
+static void control_serve(DaemonControl *ctl, int listen_fd) {
+    while (!ctl->stop) {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        struct timeval tv = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        std::string request;
+        if (read_frame(fd, &request)) {
+            write_frame(fd, control_handle(ctl, request));
+        }
+        close(fd);
+    }
+}
+
+static int control_listen(const std::string &path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(path.substr(0, slash).c_str(), 0700);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    ::unlink(path.c_str());
+    // The socket is created 0600 so nobody else can connect before chmod.
+    mode_t old_umask = umask(0077);
+    int bound = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || chmod(path.c_str(), 0600) != 0 || listen(fd, 8) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static int control_client(const std::string &path, const std::vector<std::string> &args) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::printf("control socket path too long: %s\n", path.c_str());
+        return 2;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        std::printf("cannot connect to %s: %s (is timevault --daemon running?)\n", path.c_str(), std::strerror(errno));
+        if (fd >= 0) close(fd);
+        return 2;
+    }
+    std::string request;
+    for (const auto &arg : args) {
+        if (!request.empty()) request += '\n';
+        request += arg;
+    }
+    std::string reply;
+    bool ok = write_frame(fd, request) && read_frame(fd, &reply);
+    close(fd);
+    if (!ok) {
+        std::printf("no reply from %s\n", path.c_str());
+        return 2;
+    }
+    std::vector<std::string> lines = split_lines(reply);
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (i == 0 && lines[i] == "ok") continue;
+        std::printf("%s\n", lines[i].c_str());
+    }
+    return !lines.empty() && lines[0] == "ok" ? 0 : 1;
+}
+
+static const int DAEMON_CATCH_UP_MINUTES = 24 * 60;
+
+// Keeps the parsed config, dependency graph and job history in memory and
+// runs jobs whose schedule matches the current minute. Minutes that pass
+// while a run is in progress are checked afterwards so a due job is started
+// late rather than skipped. The config is reloaded when its file is replaced
+// or rewritten, or on SIGHUP; a config that fails to load leaves the previous
+// one in effect. Jobs enqueued over the control socket run as soon as the
+// daemon is idle.
+static int run_daemon(
+    const std::string &config_path,
+    const std::vector<std::string> &rsync_extra,
+    const RunMode &mode,
+    int max_parallel,
+    bool use_cache,
+    const RunOutputs &outputs
+) {
+    FileLock daemon_lock;
+    std::string lock_path = std::string(LOCK_DIR) + "/timevault-daemon.pid";
+    int lock_rc = lock_acquire(lock_path, 0, &daemon_lock, nullptr);
+    if (lock_rc != 1) {
+        if (lock_rc == 0) {
+            std::printf("timevault daemon is already running\n");
+            return 3;
+        }
+        std::printf("failed to lock %s: %s (need write permission; try sudo or adjust permissions)\n", lock_path.c_str(), std::strerror(errno));
+        return 2;
+    }
+
+    DaemonConfig state;
+    std::string err;
+    if (!daemon_load_config(config_path, mode, use_cache, &state, &err)) {
+        std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
+        lock_release(&daemon_lock);
+        return 2;
+    }
+    JobHistory history;
+    load_job_history(state.cfg.history_path, &history);
+
+    size_t slash = config_path.rfind('/');
+    std::string config_dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : config_path.substr(0, slash));
+    std::string config_name = slash == std::string::npos ? config_path : config_path.substr(slash + 1);
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, config_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::printf("cannot watch %s for changes: %s (use SIGHUP to reload)\n", config_dir.c_str(), std::strerror(errno));
+        if (inotify_fd >= 0) close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    DaemonControl ctl;
+    ctl.state = &state;
+    int wake[2] = {-1, -1};
+    if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        std::printf("cannot create wakeup pipe: %s\n", std::strerror(errno));
+        if (inotify_fd >= 0) close(inotify_fd);
+        lock_release(&daemon_lock);
+        return 2;
+    }
+    ctl.wake_fd = wake[1];
+    std::string socket_path = control_socket_path(state.cfg);
+    int listen_fd = control_listen(socket_path);
+    std::thread control_thread;
+    if (listen_fd < 0) {
+        std::printf("cannot listen on %s: %s (control socket disabled)\n", socket_path.c_str(), std::strerror(errno));
+    } else {
+        control_thread = std::thread(control_serve, &ctl, listen_fd);
+    }
+
+    daemon_wake_fd = wake[1];
+    daemon_running = true;
+
+    size_t scheduled = 0;
+    for (const auto &job : state.cfg.jobs) {
+        if (!job.schedule.empty() && job.run_policy != RunPolicy::Off) scheduled++;
+    }
+    std::printf("daemon started with %zu job(s), %zu scheduled\n", state.cfg.jobs.size(), scheduled);
+    std::fflush(stdout);
+
+    time_t next_minute = (std::time(nullptr) / 60 + 1) * 60;
+    while (!daemon_stop) {
+        time_t now = std::time(nullptr);
+        if (now < next_minute) {
+            struct pollfd pfds[2] = {{wake[0], POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+            int wait_ms = static_cast<int>(next_minute - now) * 1000;
+            int ready = poll(pfds, inotify_fd >= 0 ? 2 : 1, wait_ms);
+            bool reload = daemon_reload;
+            if (ready > 0 && (pfds[1].revents & POLLIN) && config_file_changed(inotify_fd, config_name)) reload = true;
+            if (ready > 0 && (pfds[0].revents & POLLIN)) {
+                char buf[64];
+                while (::read(wake[0], buf, sizeof(buf)) > 0) {
+                }
+            }
+            if (reload && !daemon_stop) {
+                daemon_reload = false;
+                DaemonConfig fresh;
+                err.clear();
+                if (daemon_load_config(config_path, mode, use_cache, &fresh, &err)) {
+                    if (fresh.cfg.history_path != state.cfg.history_path) {
+                        history = JobHistory();
+                        load_job_history(fresh.cfg.history_path, &history);
+                    }
+                    std::lock_guard<std::mutex> guard(ctl.mu);
+                    state = std::move(fresh);
+                    std::printf("reloaded config %s with %zu job(s)\n", config_path.c_str(), state.cfg.jobs.size());
+                } else {
+                    std::printf("failed to reload config %s: %s (keeping previous config)\n", config_path.c_str(), err.c_str());
+                }
+                std::fflush(stdout);
+            }
+            std::vector<DemandRequest> demand;
+            {
+                std::lock_guard<std::mutex> guard(ctl.mu);
+                demand.swap(ctl.queue);
+            }
+            if (!demand.empty() && !daemon_stop) {
+                std::vector<std::string> roots;
+                for (const auto &req : demand) {
+                    roots.insert(roots.end(), req.roots.begin(), req.roots.end());
+                }
+                daemon_run_jobs(state, roots, rsync_extra, mode, max_parallel, outputs, "demand run", &history);
+            }
+            continue;
+        }
+
+        if (now - next_minute >= 60 && mode.verbose) {
+            std::printf("checking %lld missed minute(s)\n", static_cast<long long>((now - next_minute) / 60));
+        }
+        time_t first = std::max(next_minute, now - DAEMON_CATCH_UP_MINUTES * 60);
+        std::vector<std::string> roots;
+        for (size_t i = 0; i < state.cfg.jobs.size(); i++) {
+            const Job &job = state.cfg.jobs[i];
+            if (job.schedule.empty() || job.run_policy == RunPolicy::Off) continue;
+            for (time_t t = first; t <= now; t += 60) {
+                struct tm tm;
+                localtime_r(&t, &tm);
+                if (cron_matches(state.schedules[i], tm)) {
+                    roots.push_back(job.name);
+                    break;
+                }
+            }
+        }
+        next_minute = (now / 60 + 1) * 60;
+        if (!roots.empty() && !daemon_stop) {
+            daemon_run_jobs(state, roots, rsync_extra, mode, max_parallel, outputs, "scheduled run", &history);
+        }
+    }
+
+    std::printf("daemon stopping\n");
+    daemon_running = false;
+    daemon_wake_fd = -1;
+    ctl.stop = true;
+    if (control_thread.joinable()) control_thread.join();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        ::unlink(socket_path.c_str());
+    }
+    close(wake[0]);
+    close(wake[1]);
+    if (inotify_fd >= 0) close(inotify_fd);
+    lock_release(&daemon_lock);
+    return 0;
+}
+
+// --search: which snapshots hold a path or glob (fnmatch, '*' crosses
+// '/'), relative to the snapshot root. Snapshots with a manifest answer from
+// it: an exact path inflates one block, a glob only the blocks sharing its
+// literal prefix. Snapshots without one are checked on disk, in parallel:
+// an lstat for an exact path, a walk below the literal prefix for a glob.
+struct SearchHit {
+    std::string snapshot;
+    ManifestEntry entry;
+    bool scanned = false;
+};
+
+static bool is_glob(const std::string &pattern) {
+    return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+static std::string glob_prefix(const std::string &pattern) {
+    return pattern.substr(0, pattern.find_first_of("*?[\\"));
+}
+
+static void search_manifest(const ManifestView &view, const std::string &pattern, const std::string &snapshot, std::vector<SearchHit> *hits) {
+    if (view.header.block_count == 0) return;
+    if (!is_glob(pattern)) {
+        SearchHit hit;
+        if (manifest_lookup(view, pattern, &hit.entry)) {
+            hit.snapshot = snapshot;
+            hits->push_back(std::move(hit));
+        }
+        return;
+    }
+    std::string prefix = glob_prefix(pattern);
+    std::vector<ManifestEntry> entries;
+    for (uint32_t i = manifest_find_block(view, prefix); i < view.header.block_count; i++) {
+        if (i > 0 && manifest_block_key(view, i).compare(0, prefix.size(), prefix) > 0) break;
+        if (!manifest_read_block(view, i, &entries)) return;
+        for (auto &e : entries) {
+            if (e.path.compare(0, prefix.size(), prefix) != 0) continue;
+            if (fnmatch(pattern.c_str(), e.path.c_str(), 0) == 0) {
+                SearchHit hit;
+                hit.snapshot = snapshot;
+                hit.entry = std::move(e);
+                hits->push_back(std::move(hit));
+            }
+        }
+    }
+}
+
+static thread_local std::vector<ManifestEntry> *search_walk_out = nullptr;
+static thread_local const std::string *search_walk_pattern = nullptr;
+static thread_local size_t search_walk_root = 0;
+
+static int search_walk_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)typeflag;
+    (void)ftwbuf;
+    if (std::strlen(fpath) <= search_walk_root) return 0;
+    const char *rel = fpath + search_walk_root + 1;
+    if (fnmatch(search_walk_pattern->c_str(), rel, 0) != 0) return 0;
+    ManifestEntry e;
+    e.path = rel;
+    e.size = static_cast<uint64_t>(sb->st_size);
+    e.mtime_ns = static_cast<int64_t>(sb->st_mtim.tv_sec) * 1000000000LL + sb->st_mtim.tv_nsec;
+    e.mode = sb->st_mode;
+    e.inode = sb->st_ino;
+    search_walk_out->push_back(std::move(e));
+    return 0;
+}
+
+static void search_tree(const std::string &root, const std::string &pattern, std::vector<ManifestEntry> *out) {
+    if (!is_glob(pattern)) {
+        struct stat st;
+        std::string path = root + "/" + pattern;
+        if (lstat(path.c_str(), &st) != 0) return;
+        ManifestEntry e;
+        e.path = pattern;
+        e.size = static_cast<uint64_t>(st.st_size);
+        e.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+        e.mode = st.st_mode;
+        e.inode = st.st_ino;
+        out->push_back(std::move(e));
+        return;
+    }
+    std::string prefix = glob_prefix(pattern);
+    size_t slash = prefix.rfind('/');
+    std::string start = slash == std::string::npos ? root : root + "/" + prefix.substr(0, slash);
+    search_walk_out = out;
+    search_walk_pattern = &pattern;
+    search_walk_root = root.size();
+    nftw(start.c_str(), search_walk_cb, 64, FTW_PHYS);
+    search_walk_out = nullptr;
+    search_walk_pattern = nullptr;
+}
+
+static void search_dest(const std::string &dest, const std::string &pattern, std::vector<SearchHit> *hits, int *scanned) {
+    std::vector<std::string> snapshots;
+    if (!list_snapshots(dest, &snapshots)) return;
+    std::sort(snapshots.begin(), snapshots.end());
+    std::vector<std::string> unindexed;
+    for (const auto &snapshot : snapshots) {
+        ManifestView view;
+        std::string err;
+        if (!manifest_open(manifest_path(dest, snapshot), &view, &err)) {
+            unindexed.push_back(snapshot);
+            continue;
+        }
+        search_manifest(view, pattern, snapshot, hits);
+        manifest_close(&view);
+    }
+    *scanned += static_cast<int>(unindexed.size());
+    std::vector<std::vector<ManifestEntry>> found(unindexed.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < unindexed.size(); i = next++) {
+            search_tree(dest + "/" + unindexed[i], pattern, &found[i]);
+        }
+    };
+    size_t threads = std::min<size_t>(unindexed.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+    for (size_t i = 0; i < unindexed.size(); i++) {
+        std::sort(found[i].begin(), found[i].end(), [](const ManifestEntry &a, const ManifestEntry &b) {
+            return a.path < b.path;
+        });
+        for (auto &e : found[i]) {
+            SearchHit hit;
+            hit.snapshot = unindexed[i];
+            hit.entry = std::move(e);
+            hit.scanned = true;
+            hits->push_back(std::move(hit));
+        }
+    }
+    std::stable_sort(hits->begin(), hits->end(), [](const SearchHit &a, const SearchHit &b) {
+        return a.snapshot < b.snapshot;
+    });
+}
+
+// Runs fn(job) for each job with its disk mounted and destination verified
+// through the same mount sessions backup_jobs uses; jobs sharing a disk
+// share one mount, read-only unless fn writes to the disk. Returns 1 if any
+// job was skipped.
+template <typename F>
+static int for_each_mounted_job(const std::vector<Job> &jobs, const Config &cfg, bool read_only, const RunMode &mode, F fn) {
+    for (const auto &job : jobs) mount_session_expect(job.mount);
+    int exit_code = 0;
+    for (const auto &job : jobs) {
+        JobMetrics job_metrics;
+        std::string err;
+        if (!mount_session_acquire(job, mode, &job_metrics, &err, read_only)) {
+            std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
+            mount_session_finish(job.mount, mode);
+            exit_code = 1;
+            continue;
+        }
+        if (!verify_destination(job, cfg.mount_prefix, &err)) {
+            std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
+            exit_code = 1;
+        } else if (fn(job) != 0) {
+            exit_code = 1;
+        }
+        mount_session_release(job.mount, mode);
+        mount_session_finish(job.mount, mode);
+    }
+    return exit_code;
+}
+
+static int run_search(const std::vector<Job> &jobs, const Config &cfg, const std::string &query, const RunMode &mode) {
+    std::string pattern = query;
+    while (!pattern.empty() && pattern[0] == '/') pattern.erase(0, 1);
+    if (pattern.empty()) {
+        std::printf("--search requires a path or glob below the snapshot root\n");
+        return 2;
+    }
+    long total = 0;
+    int exit_code = for_each_mounted_job(jobs, cfg, true, mode, [&](const Job &job) {
+        double started = monotonic_seconds();
+        std::vector<SearchHit> hits;
+        int scanned = 0;
+        search_dest(job.dest, pattern, &hits, &scanned);
+        std::printf("job %s: %zu match(es)", job.name.c_str(), hits.size());
+        if (scanned > 0) std::printf(", %d snapshot(s) without manifest scanned", scanned);
+        std::printf(" in %.3fs\n", monotonic_seconds() - started);
+        for (const auto &hit : hits) {
+            char when[32];
+            time_t mtime = static_cast<time_t>(hit.entry.mtime_ns / 1000000000LL);
+            struct tm tm;
+            localtime_r(&mtime, &tm);
+            std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+            std::printf("  %s  %12llu  %s  %10llu  %s%s%s\n", hit.snapshot.c_str(),
+                static_cast<unsigned long long>(hit.entry.size), when,
+                static_cast<unsigned long long>(hit.entry.inode), hit.entry.path.c_str(),
+                S_ISDIR(hit.entry.mode) ? "/" : "", hit.scanned ? "  (scanned)" : "");
+        }
+        total += static_cast<long>(hits.size());
+        return 0;
+    });
+    if (jobs.size() > 1) std::printf("%ld match(es) in %zu job(s)\n", total, jobs.size());
+    return exit_code;
+}
+
+// --space: per-snapshot total and unique bytes from the catalog, recounting
+// only what changed since it was written (everything with --space-full).
+// Rewriting the catalog needs the disk rw.
+static int run_space(const std::vector<Job> &jobs, const Config &cfg, bool full, const RunMode &mode) {
+    return for_each_mounted_job(jobs, cfg, false, mode, [&](const Job &job) {
+        double started = monotonic_seconds();
+        std::vector<SnapshotUsage> usage;
+        std::string err;
+        bool ok = update_snapshot_catalog(job.dest, full, &usage, &err);
+        if (!ok) std::printf("job %s: %s\n", job.name.c_str(), err.c_str());
+        std::printf("job %s: %zu snapshot(s) in %.3fs\n", job.name.c_str(), usage.size(), monotonic_seconds() - started);
+        std::printf("  %-10s %10s %16s %16s %16s\n", "snapshot", "files", "total bytes", "unique bytes", "shared bytes");
+        for (const auto &u : usage) {
+            std::printf("  %-10s %10llu %16llu %16llu %16llu\n", u.name.c_str(),
+                static_cast<unsigned long long>(u.files), static_cast<unsigned long long>(u.total_bytes),
+                static_cast<unsigned long long>(u.unique_bytes),
+                static_cast<unsigned long long>(u.total_bytes - u.unique_bytes));
+        }
+        return ok ? 0 : 1;
+    });
+}
+
+// --restore copies <dest>/<snapshot>[/<path>] to a target that must not
+// exist yet (or be an empty directory, which a single file is restored into). Directories are created first,
+// regular files are copied largest first by a pool of workers with
+// copy_file_range (read/write where the kernel refuses it), hardlinks
+// inside the restored tree are relinked to their first copy, and owners,
+// modes and times are applied in one pass at the end so no copy runs into
+// a read-only mode and directory mtimes are not disturbed afterwards.
+enum class RestoreKind {
+    Dir,
+    File,
+    Link,
+    Symlink,
+    Special,
+};
+
+struct RestoreEntry {
+    std::string rel;
+    struct stat st;
+    RestoreKind kind = RestoreKind::File;
+    size_t link_to = 0;
+};
+
+struct RestoreProgress {
+    uint64_t total_files = 0;
+    uint64_t total_bytes = 0;
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+};
+
+static thread_local std::vector<RestoreEntry> *restore_walk_out = nullptr;
+static thread_local std::unordered_map<ino_t, size_t> *restore_walk_inodes = nullptr;
+static thread_local size_t restore_walk_root = 0;
+
+static int restore_walk_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)typeflag;
+    (void)ftwbuf;
+    RestoreEntry e;
+    if (std::strlen(fpath) > restore_walk_root) e.rel = fpath + restore_walk_root + 1;
+    e.st = *sb;
+    if (S_ISDIR(sb->st_mode)) {
+        e.kind = RestoreKind::Dir;
+    } else if (S_ISLNK(sb->st_mode)) {
+        e.kind = RestoreKind::Symlink;
+    } else if (!S_ISREG(sb->st_mode)) {
+        e.kind = RestoreKind::Special;
+    } else if (sb->st_nlink > 1) {
+        // Snapshots share most inodes with their neighbours, so only a
+        // second path to the same inode inside this tree becomes a link.
+        auto it = restore_walk_inodes->emplace(sb->st_ino, restore_walk_out->size());
+        if (!it.second) {
+            e.kind = RestoreKind::Link;
+            e.link_to = it.first->second;
+        }
+    }
+    restore_walk_out->push_back(std::move(e));
+    return 0;
+}
+
+static std::string restore_target(const std::string &target, const RestoreEntry &e) {
+    return e.rel.empty() ? target : target + "/" + e.rel;
+}
+
+static bool restore_copy_file(const std::string &src, const std::string &dst, std::vector<char> *buf,
+                              RestoreProgress *progress, std::string *err) {
+    int in = ::open(src.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) {
+        *err = "cannot open " + src + ": " + std::strerror(errno);
+        return false;
+    }
+    int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out < 0) {
+        *err = "cannot create " + dst + ": " + std::strerror(errno);
+        ::close(in);
+        return false;
+    }
+    bool use_range = true;
+    bool ok = true;
+    for (;;) {
+        ssize_t n;
+        if (use_range) {
+            n = copy_file_range(in, nullptr, out, nullptr, 64u << 20, 0);
+            // Both offsets advance, so falling back mid-file is safe.
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_range = false;
+                continue;
+            }
+        } else {
+            n = ::read(in, buf->data(), buf->size());
+            if (n > 0 && !write_all(out, buf->data(), static_cast<size_t>(n))) n = -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            *err = "cannot copy " + src + ": " + std::strerror(errno);
+            ok = false;
+            break;
+        }
+        if (n == 0) break;
+        progress->bytes.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+    }
+    ::close(in);
+    if (::close(out) != 0 && ok) {
+        *err = "cannot write " + dst + ": " + std::strerror(errno);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool restore_metadata(const std::string &path, const struct stat &st, bool owners, std::string *err) {
+    if (owners && lchown(path.c_str(), st.st_uid, st.st_gid) != 0) {
+        *err = "cannot chown " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    // chmod after chown, which clears setuid/setgid.
+    if (!S_ISLNK(st.st_mode) && chmod(path.c_str(), st.st_mode & 07777) != 0) {
+        *err = "cannot chmod " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+        *err = "cannot set times on " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// Runs fn(i) for i in [0, count) on up to workers threads, handing out
+// indices in order.
+template <typename F>
+static void restore_parallel(size_t count, size_t workers, F fn) {
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min(workers, count); t++) pool.emplace_back(worker);
+    worker();
+    for (auto &th : pool) th.join();
+}
+
+static void restore_report_error(RestoreProgress *progress, const std::string &err) {
+    static std::mutex report_mutex;
+    progress->errors.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(report_mutex);
+    std::printf("restore: %s\n", err.c_str());
+}
+
+static void restore_print_progress(const RestoreProgress &progress, double elapsed) {
+    uint64_t bytes = progress.bytes.load(std::memory_order_relaxed);
+    std::printf("restore: %llu/%llu files, %.1f/%.1f MiB, %.1f MiB/s\n",
+        static_cast<unsigned long long>(progress.files.load(std::memory_order_relaxed)),
+        static_cast<unsigned long long>(progress.total_files),
+        static_cast<double>(bytes) / 1048576.0, static_cast<double>(progress.total_bytes) / 1048576.0,
+        elapsed > 0.0 ? static_cast<double>(bytes) / 1048576.0 / elapsed : 0.0);
+    std::fflush(stdout);
+}
+
+static bool restore_target_usable(const std::string &target, std::string *err) {
+    struct stat st;
+    if (lstat(target.c_str(), &st) != 0) {
+        if (errno == ENOENT) return true;
+        *err = "cannot stat " + target + ": " + std::strerror(errno);
+        return false;
+    }
+    DIR *d = S_ISDIR(st.st_mode) ? opendir(target.c_str()) : nullptr;
+    if (!d) {
+        *err = target + " exists and is not an empty directory";
+        return false;
+    }
+    bool empty = true;
+    struct dirent *e;
+    while (empty && (e = readdir(d)) != nullptr) {
+        empty = std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0;
+    }
+    closedir(d);
+    if (!empty) *err = target + " exists and is not empty";
+    return empty;
+}
+
+// Splits <snapshot>[/<path>] and checks both name something inside dest;
+// "current" is resolved to the snapshot it points at. A symlinked directory
+// on the way to <path> must not lead out of the snapshot; <path> itself may
+// be a symlink, which is restored as one.
+static bool restore_source(const std::string &dest, const std::string &spec, std::string *snapshot,
+                           std::string *root, std::string *err) {
+    size_t slash = spec.find('/');
+    *snapshot = spec.substr(0, slash);
+    std::string sub = slash == std::string::npos ? "" : spec.substr(slash + 1);
+    if (*snapshot == "current") {
+        char buf[PATH_MAX];
+        ssize_t n = readlink((dest + "/current").c_str(), buf, sizeof(buf) - 1);
+        if (n <= 0) {
+            *err = "no current snapshot in " + dest;
+            return false;
+        }
+        std::string link(buf, static_cast<size_t>(n));
+        *snapshot = link.substr(link.find_last_of('/') + 1);
+    }
+    std::vector<std::string> snapshots;
+    if (!list_snapshots(dest, &snapshots)
+        || std::find(snapshots.begin(), snapshots.end(), *snapshot) == snapshots.end()) {
+        *err = "no snapshot " + *snapshot + " in " + dest;
+        return false;
+    }
+    std::string clean;
+    size_t pos = 0;
+    while (pos <= sub.size()) {
+        size_t end = sub.find('/', pos);
+        if (end == std::string::npos) end = sub.size();
+        std::string part = sub.substr(pos, end - pos);
+        if (part == "..") {
+            *err = "restore path must stay inside the snapshot: " + sub;
+            return false;
+        }
+        if (!part.empty() && part != ".") clean += "/" + part;
+        pos = end + 1;
+    }
+    *root = dest + "/" + *snapshot + clean;
+    if (clean.empty()) return true;
+    std::string parent = dest + "/" + *snapshot + clean.substr(0, clean.find_last_of('/'));
+    char real_snapshot[PATH_MAX];
+    char real_parent[PATH_MAX];
+    if (!realpath((dest + "/" + *snapshot).c_str(), real_snapshot) || !realpath(parent.c_str(), real_parent)) {
+        *err = "cannot resolve " + *root + ": " + std::strerror(errno);
+        return false;
+    }
+    std::string inside = std::string(real_parent) + "/";
+    if (inside.compare(0, std::strlen(real_snapshot) + 1, std::string(real_snapshot) + "/") != 0) {
+        *err = "restore path must stay inside the snapshot: " + sub;
+        return false;
+    }
+    return true;
+}
+
+static int restore_job(const Job &job, const std::string &spec, const std::string &requested, size_t workers,
+                       const RunMode &mode) {
+    std::string target = requested;
+    std::string snapshot;
+    std::string root;
+    std::string err;
+    if (!restore_source(job.dest, spec, &snapshot, &root, &err)) {
+        std::printf("job %s: %s\n", job.name.c_str(), err.c_str());
+        return 1;
+    }
+    char real_root[PATH_MAX];
+    char real_parent[PATH_MAX];
+    size_t cut = target.find_last_of('/');
+    std::string parent = cut == std::string::npos ? "." : cut == 0 ? "/" : target.substr(0, cut);
+    if (!realpath(root.c_str(), real_root)) {
+        std::printf("job %s: cannot restore %s: %s\n", job.name.c_str(), root.c_str(), std::strerror(errno));
+        return 1;
+    }
+    if (!realpath(parent.c_str(), real_parent)) {
+        std::printf("job %s: cannot restore to %s: %s\n", job.name.c_str(), target.c_str(), std::strerror(errno));
+        return 1;
+    }
+    std::string inside = std::string(real_parent) + "/";
+    if (inside.compare(0, std::strlen(real_root) + 1, std::string(real_root) + "/") == 0) {
+        std::printf("job %s: cannot restore %s into itself\n", job.name.c_str(), root.c_str());
+        return 1;
+    }
+    if (!restore_target_usable(target, &err)) {
+        std::printf("job %s: %s\n", job.name.c_str(), err.c_str());
+        return 1;
+    }
+    // Like cp, a single file restored to an existing directory lands in it.
+    struct stat root_st;
+    struct stat target_st;
+    if (lstat(root.c_str(), &root_st) == 0 && !S_ISDIR(root_st.st_mode) &&
+        lstat(target.c_str(), &target_st) == 0 && S_ISDIR(target_st.st_mode)) {
+        target += root.substr(root.find_last_of('/'));
+    }
+
+    double started = monotonic_seconds();
+    std::vector<RestoreEntry> entries;
+    std::unordered_map<ino_t, size_t> inodes;
+    restore_walk_out = &entries;
+    restore_walk_inodes = &inodes;
+    restore_walk_root = root.size();
+    int rc = nftw(root.c_str(), restore_walk_cb, 64, FTW_PHYS | FTW_MOUNT);
+    restore_walk_out = nullptr;
+    restore_walk_inodes = nullptr;
+    if (rc != 0) {
+        std::printf("job %s: cannot walk %s: %s\n", job.name.c_str(), root.c_str(), std::strerror(errno));
+        return 1;
+    }
+
+    RestoreProgress progress;
+    std::vector<size_t> files;
+    uint64_t dirs = 0;
+    uint64_t links = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].kind == RestoreKind::File) {
+            files.push_back(i);
+            progress.total_bytes += static_cast<uint64_t>(entries[i].st.st_size);
+        } else if (entries[i].kind == RestoreKind::Dir) {
+            dirs++;
+        } else if (entries[i].kind == RestoreKind::Link) {
+            links++;
+        }
+    }
+    progress.total_files = files.size();
+    std::string what = root.substr(job.dest.size() + 1);
+    std::printf("job %s: restore %s to %s: %zu file(s), %llu hardlink(s), %llu dir(s), %.1f MiB\n",
+        job.name.c_str(), what.c_str(), target.c_str(), files.size(),
+        static_cast<unsigned long long>(links), static_cast<unsigned long long>(dirs),
+        static_cast<double>(progress.total_bytes) / 1048576.0);
+    if (mode.dry_run) return 0;
+
+    // Directories in walk order (parents first), writable until the
+    // metadata pass; an existing empty target keeps its own mode until then.
+    for (const auto &e : entries) {
+        if (e.kind != RestoreKind::Dir) continue;
+        std::string path = restore_target(target, e);
+        if (mkdir(path.c_str(), 0700) != 0 && !(e.rel.empty() && errno == EEXIST)) {
+            std::printf("job %s: cannot create %s: %s\n", job.name.c_str(), path.c_str(), std::strerror(errno));
+            return 1;
+        }
+    }
+
+    // Largest first keeps one big file from finishing the run alone.
+    std::sort(files.begin(), files.end(), [&](size_t a, size_t b) {
+        return entries[a].st.st_size > entries[b].st.st_size;
+    });
+    std::mutex progress_mutex;
+    std::condition_variable progress_cv;
+    bool copying = true;
+    std::thread reporter([&]() {
+        std::unique_lock<std::mutex> lock(progress_mutex);
+        while (!progress_cv.wait_for(lock, std::chrono::seconds(2), [&]() { return !copying; })) {
+            restore_print_progress(progress, monotonic_seconds() - started);
+        }
+    });
+    restore_parallel(files.size(), workers, [&](size_t i) {
+        const RestoreEntry &e = entries[files[i]];
+        std::string copy_err;
+        static thread_local std::vector<char> io_buf(1 << 20);
+        if (!restore_copy_file(root + (e.rel.empty() ? "" : "/" + e.rel), restore_target(target, e), &io_buf,
+                               &progress, &copy_err)) {
+            restore_report_error(&progress, copy_err);
+        }
+        progress.files.fetch_add(1, std::memory_order_relaxed);
+    });
+    {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        copying = false;
+    }
+    progress_cv.notify_all();
+    reporter.join();
+
+    for (const auto &e : entries) {
+        std::string path = restore_target(target, e);
+        std::string src = root + (e.rel.empty() ? "" : "/" + e.rel);
+        bool ok = true;
+        if (e.kind == RestoreKind::Link) {
+            ok = ::link(restore_target(target, entries[e.link_to]).c_str(), path.c_str()) == 0;
+        } else if (e.kind == RestoreKind::Symlink) {
+            std::vector<char> buf(static_cast<size_t>(e.st.st_size) + 1);
+            ssize_t n = readlink(src.c_str(), buf.data(), buf.size());
+            ok = n >= 0 && symlink(std::string(buf.data(), static_cast<size_t>(n)).c_str(), path.c_str()) == 0;
+        } else if (e.kind == RestoreKind::Special) {
+            ok = S_ISSOCK(e.st.st_mode) || mknod(path.c_str(), e.st.st_mode, e.st.st_rdev) == 0;
+        }
+        if (!ok) restore_report_error(&progress, "cannot create " + path + ": " + std::strerror(errno));
+    }
+
+    // Links share their first copy's inode, and sockets were not recreated.
+    // Directories go last, deepest first, so their mtimes stick.
+    bool owners = geteuid() == 0;
+    std::vector<size_t> leaves;
+    std::vector<size_t> parents;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const RestoreEntry &e = entries[i];
+        if (e.kind == RestoreKind::Link || S_ISSOCK(e.st.st_mode)) continue;
+        (e.kind == RestoreKind::Dir ? parents : leaves).push_back(i);
+    }
+    restore_parallel(leaves.size(), workers, [&](size_t i) {
+        const RestoreEntry &e = entries[leaves[i]];
+        std::string meta_err;
+        if (!restore_metadata(restore_target(target, e), e.st, owners, &meta_err)) {
+            restore_report_error(&progress, meta_err);
+        }
+    });
+    for (auto it = parents.rbegin(); it != parents.rend(); ++it) {
+        const RestoreEntry &e = entries[*it];
+        std::string meta_err;
+        if (!restore_metadata(restore_target(target, e), e.st, owners, &meta_err)) {
+            restore_report_error(&progress, meta_err);
+        }
+    }
+
+    double elapsed = monotonic_seconds() - started;
+    restore_print_progress(progress, elapsed);
+    unsigned long long errors = progress.errors.load();
+    std::printf("job %s: restored %s to %s in %s with %zu worker(s), %llu error(s)\n", job.name.c_str(),
+        what.c_str(), target.c_str(), format_duration(elapsed).c_str(),
+        std::max<size_t>(1, std::min(workers, files.size())), errors);
+    return errors ? 1 : 0;
+}
+
+static int run_restore(const std::vector<Job> &jobs, const Config &cfg, const std::string &spec,
+                       const std::string &target, int workers, const RunMode &mode) {
+    size_t threads = workers > 0 ? static_cast<size_t>(workers) : std::max(1u, std::thread::hardware_concurrency());
+    return for_each_mounted_job(jobs, cfg, true, mode, [&](const Job &job) {
+        return restore_job(job, spec, target, threads, mode);
+    });
+}
+
+#ifdef TIMEVAULT_WITH_FUSE
+// --history-mount <dir> serves a read-only FUSE view of the selected jobs'
+// snapshots while their disks stay mounted ro through read-only sessions.
+// Their shared mount locks stay held, so backups to those disks wait (and
+// are skipped after --lock-wait) until the view is unmounted.
+//
+//   <dir>/<job>/<snapshot>/<path>            the snapshot as it was taken
+//   <dir>/<job>/versions/<path>/<snapshot>   each distinct version of a file,
+//                                            named by the first snapshot with it
+//
+// Attributes and listings come from the snapshot manifests. A lookup
+// inflates one block, and a listing jumps over each child's subtree with a
+// search of the block index, so opening a directory costs a block or two
+// per child however many entries lie below it. Snapshots without a manifest
+// are served from the tree. Inflated blocks, lookups and listings are
+// cached (dropped wholesale when full), and as snapshots never change the
+// kernel may keep entries and attributes for an hour. File data is read
+// from the snapshot itself.
+//
+//   g++ -std=c++17 -O2 -pthread -DTIMEVAULT_WITH_FUSE legacy/timevault.cpp $(pkg-config --cflags --libs fuse3) -lyaml-cpp -lz
+//   timevault --job home --history-mount /mnt/history   (fusermount3 -u to stop)
+static const char *HISTORY_VERSIONS = "versions";
+static const size_t HISTORY_CACHE_LIMIT = 65536;
+static const double HISTORY_KERNEL_TIMEOUT = 3600.0;
+
+struct HistorySnapshot {
+    uint64_t id = 0;
+    std::string name;
+    std::string root;
+    ManifestView view;
+    bool indexed = false;
+};
+
+struct HistoryJob {
+    std::string name;
+    std::vector<HistorySnapshot> snapshots;
+};
+
+struct HistoryFs {
+    std::vector<HistoryJob> jobs;
+    uid_t uid = 0;
+    gid_t gid = 0;
+    time_t started = 0;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<ManifestEntry>> blocks;
+    std::unordered_map<std::string, ManifestEntry> lookups;
+    std::unordered_map<std::string, std::vector<ManifestEntry>> listings;
+};
+
+enum class HistoryNodeKind {
+    Root,
+    Job,
+    Path,
+    Versions,
+    VersionList,
+    Version,
+};
+
+// A resolved FUSE path. Path and Version nodes are backed by
+// snapshot->root + "/" + rel; Versions is a directory of the versions tree
+// (the union of rel across snapshots) and VersionList a file shown as the
+// directory of its versions.
+struct HistoryNode {
+    HistoryNodeKind kind = HistoryNodeKind::Root;
+    const HistoryJob *job = nullptr;
+    const HistorySnapshot *snapshot = nullptr;
+    std::string rel;
+    ManifestEntry entry;
+};
+
+static HistoryFs *history_fs() {
+    return static_cast<HistoryFs *>(fuse_get_context()->private_data);
+}
+
+static std::string history_key(const HistorySnapshot &snap, const std::string &rel) {
+    return std::to_string(snap.id) + ":" + rel;
+}
+
+template <typename Map, typename Key, typename Value>
+static void history_cache_put(HistoryFs *fs, Map *cache, const Key &key, const Value &value) {
+    std::lock_guard<std::mutex> lock(fs->mutex);
+    if (cache->size() >= HISTORY_CACHE_LIMIT) cache->clear();
+    (*cache)[key] = value;
+}
+
+static bool history_block(HistoryFs *fs, const HistorySnapshot &snap, uint32_t block, std::vector<ManifestEntry> *out) {
+    uint64_t key = (snap.id << 32) | block;
+    {
+        std::lock_guard<std::mutex> lock(fs->mutex);
+        auto it = fs->blocks.find(key);
+        if (it != fs->blocks.end()) {
+            *out = it->second;
+            return true;
+        }
+    }
+    if (!manifest_read_block(snap.view, block, out)) return false;
+    history_cache_put(fs, &fs->blocks, key, *out);
+    return true;
+}
+
+static bool history_stat_entry(const std::string &path, const std::string &rel, ManifestEntry *e) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) return false;
+    e->path = rel;
+    e->size = static_cast<uint64_t>(st.st_size);
+    e->mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    e->mode = st.st_mode;
+    e->inode = st.st_ino;
+    return true;
+}
+
+// The entry for rel ("" is the snapshot root, which manifests leave out).
+static bool history_lookup(HistoryFs *fs, const HistorySnapshot &snap, const std::string &rel, ManifestEntry *out) {
+    std::string key = history_key(snap, rel);
+    {
+        std::lock_guard<std::mutex> lock(fs->mutex);
+        auto it = fs->lookups.find(key);
+        if (it != fs->lookups.end()) {
+            *out = it->second;
+            return out->mode != 0;
+        }
+    }
+    ManifestEntry e;
+    if (rel.empty() || !snap.indexed) {
+        history_stat_entry(rel.empty() ? snap.root : snap.root + "/" + rel, rel, &e);
+    } else if (snap.view.header.block_count > 0) {
+        std::vector<ManifestEntry> block;
+        if (history_block(fs, snap, manifest_find_block(snap.view, rel), &block)) {
+            auto it = std::lower_bound(block.begin(), block.end(), rel, [](const ManifestEntry &a, const std::string &b) {
+                return a.path < b;
+            });
+            if (it != block.end() && it->path == rel) e = *it;
+        }
+    }
+    // Misses are cached too, as mode 0.
+    history_cache_put(fs, &fs->lookups, key, e);
+    *out = e;
+    return e.mode != 0;
+}
+
+// Children of dir in path order. Manifests sort full paths bytewise, so a
+// child's subtree is one run of "<dir>/<child>/..." entries, though not
+// always straight after the child: siblings such as "<child>-x" fall in
+// between ('-' is below '/') and are listed before the run is reached. '0'
+// is the byte after '/', so on reaching the run the scan restarts at
+// "<dir>/<child>0", the first path past it.
+static void history_list(HistoryFs *fs, const HistorySnapshot &snap, const std::string &dir, std::vector<ManifestEntry> *out) {
+    std::string key = history_key(snap, dir);
+    {
+        std::lock_guard<std::mutex> lock(fs->mutex);
+        auto it = fs->listings.find(key);
+        if (it != fs->listings.end()) {
+            *out = it->second;
+            return;
+        }
+    }
+    out->clear();
+    std::string prefix = dir.empty() ? "" : dir + "/";
+    if (!snap.indexed) {
+        std::string path = dir.empty() ? snap.root : snap.root + "/" + dir;
+        DIR *d = opendir(path.c_str());
+        struct dirent *de;
+        while (d && (de = readdir(d)) != nullptr) {
+            if (std::strcmp(de->d_name, ".") == 0 || std::strcmp(de->d_name, "..") == 0) continue;
+            ManifestEntry e;
+            if (history_stat_entry(path + "/" + de->d_name, prefix + de->d_name, &e)) out->push_back(std::move(e));
+        }
+        if (d) closedir(d);
+        std::sort(out->begin(), out->end(), [](const ManifestEntry &a, const ManifestEntry &b) {
+            return a.path < b.path;
+        });
+    } else {
+        std::string from = prefix;
+        std::vector<ManifestEntry> block;
+        bool more = snap.view.header.block_count > 0;
+        while (more) {
+            bool jumped = false;
+            for (uint32_t b = manifest_find_block(snap.view, from); more && !jumped && b < snap.view.header.block_count; b++) {
+                if (!history_block(fs, snap, b, &block)) {
+                    more = false;
+                    break;
+                }
+                auto it = std::lower_bound(block.begin(), block.end(), from, [](const ManifestEntry &a, const std::string &p) {
+                    return a.path < p;
+                });
+                for (; it != block.end(); ++it) {
+                    if (it->path.compare(0, prefix.size(), prefix) != 0) {
+                        more = false;
+                        break;
+                    }
+                    size_t slash = it->path.find('/', prefix.size());
+                    if (slash != std::string::npos) {
+                        from = it->path.substr(0, slash) + "0";
+                        jumped = true;
+                        break;
+                    }
+                    out->push_back(*it);
+                }
+            }
+            if (!jumped) more = false;
+        }
+    }
+    for (const auto &e : *out) history_cache_put(fs, &fs->lookups, history_key(snap, e.path), e);
+    history_cache_put(fs, &fs->listings, key, *out);
+}
+
+// Hardlinked copies share the inode; a file rsync rewrote with the same
+// size, mtime and crc is the same version too.
+static bool history_same_version(const ManifestEntry &a, const ManifestEntry &b) {
+    return a.inode == b.inode || (a.size == b.size && a.mtime_ns == b.mtime_ns && a.crc == b.crc);
+}
+
+// Distinct versions of a non-directory, oldest first, each with the first
+// snapshot that has it.
+static void history_versions(HistoryFs *fs, const HistoryJob &job, const std::string &rel,
+                             std::vector<std::pair<const HistorySnapshot *, ManifestEntry>> *out) {
+    out->clear();
+    for (const auto &snap : job.snapshots) {
+        ManifestEntry e;
+        if (!history_lookup(fs, snap, rel, &e) || S_ISDIR(e.mode)) continue;
+        if (out->empty() || !history_same_version(out->back().second, e)) out->emplace_back(&snap, e);
+    }
+}
+
+// The newest snapshot's entry for rel in the versions tree.
+static const HistorySnapshot *history_latest(HistoryFs *fs, const HistoryJob &job, const std::string &rel, ManifestEntry *out) {
+    for (auto it = job.snapshots.rbegin(); it != job.snapshots.rend(); ++it) {
+        if (history_lookup(fs, *it, rel, out)) return &*it;
+    }
+    return nullptr;
+}
+
+static ManifestEntry history_dir_entry(const HistoryFs *fs) {
+    ManifestEntry e;
+    e.mode = S_IFDIR | 0555;
+    e.mtime_ns = static_cast<int64_t>(fs->started) * 1000000000LL;
+    return e;
+}
+
+static bool history_resolve(HistoryFs *fs, const char *path, HistoryNode *node) {
+    std::vector<std::string> parts;
+    for (const char *p = path; *p;) {
+        while (*p == '/') p++;
+        const char *end = p;
+        while (*end && *end != '/') end++;
+        if (end != p) parts.emplace_back(p, static_cast<size_t>(end - p));
+        p = end;
+    }
+    node->entry = history_dir_entry(fs);
+    if (parts.empty()) {
+        node->kind = HistoryNodeKind::Root;
+        return true;
+    }
+    for (const auto &job : fs->jobs) {
+        if (job.name == parts[0]) node->job = &job;
+    }
+    if (!node->job) return false;
+    if (parts.size() == 1) {
+        node->kind = HistoryNodeKind::Job;
+        return true;
+    }
+    for (size_t i = 2; i < parts.size(); i++) node->rel += (i > 2 ? "/" : "") + parts[i];
+    if (parts[1] != HISTORY_VERSIONS) {
+        for (const auto &snap : node->job->snapshots) {
+            if (snap.name == parts[1]) node->snapshot = &snap;
+        }
+        node->kind = HistoryNodeKind::Path;
+        return node->snapshot && history_lookup(fs, *node->snapshot, node->rel, &node->entry);
+    }
+    node->kind = HistoryNodeKind::Versions;
+    if (node->rel.empty()) return true;
+    ManifestEntry latest;
+    if (history_latest(fs, *node->job, node->rel, &latest)) {
+        if (S_ISDIR(latest.mode)) {
+            node->entry = latest;
         } else {
-            FILE *mf = std::fopen(marker.c_str(), "w");
-            if (!mf) {
-                *err = "create " + marker + ": " + std::strerror(errno);
-            } else {
-                std::fclose(mf);
-            }
+            node->kind = HistoryNodeKind::VersionList;
+        }
+        return true;
+    }
+    size_t slash = node->rel.find_last_of('/');
+    if (slash == std::string::npos) return false;
+    std::string file = node->rel.substr(0, slash);
+    std::vector<std::pair<const HistorySnapshot *, ManifestEntry>> versions;
+    history_versions(fs, *node->job, file, &versions);
+    for (const auto &v : versions) {
+        if (v.first->name == parts.back()) {
+            node->kind = HistoryNodeKind::Version;
+            node->snapshot = v.first;
+            node->rel = file;
+            node->entry = v.second;
+            return true;
         }
     }
+    return false;
+}
 
-    run_command({"mount", "-oremount,ro", mount}, mode);
-    run_command({"umount", mount}, mode);
-    untrack_mount(mount);
+// Nothing below the mount is writable, whatever the snapshot's modes say.
+static void history_fill_stat(const HistoryFs *fs, const ManifestEntry &e, struct stat *st) {
+    std::memset(st, 0, sizeof(*st));
+    st->st_mode = e.mode & ~static_cast<mode_t>(0222);
+    st->st_nlink = S_ISDIR(e.mode) ? 2 : 1;
+    st->st_uid = fs->uid;
+    st->st_gid = fs->gid;
+    st->st_size = static_cast<off_t>(e.size);
+    st->st_blocks = static_cast<blkcnt_t>((e.size + 511) / 512);
+    st->st_mtim.tv_sec = static_cast<time_t>(e.mtime_ns / 1000000000LL);
+    st->st_mtim.tv_nsec = static_cast<long>(e.mtime_ns % 1000000000LL);
+    st->st_atim = st->st_mtim;
+    st->st_ctim = st->st_mtim;
+}
 
-    return err->empty();
+static std::string history_real_path(const HistoryNode &node) {
+    return node.rel.empty() ? node.snapshot->root : node.snapshot->root + "/" + node.rel;
 }
 
-static void format_time(char *buf, size_t len, time_t t) {
-    struct tm tm;
-    localtime_r(&t, &tm);
-    std::strftime(buf, len, "%d-%m-%Y %H:%M", &tm);
+static void *history_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void)conn;
+    cfg->entry_timeout = HISTORY_KERNEL_TIMEOUT;
+    cfg->attr_timeout = HISTORY_KERNEL_TIMEOUT;
+    cfg->negative_timeout = HISTORY_KERNEL_TIMEOUT;
+    cfg->kernel_cache = 1;
+    return fuse_get_context()->private_data;
 }
 
-static void format_day(char *buf, size_t len, time_t t) {
-    struct tm tm;
-    localtime_r(&t, &tm);
-    std::strftime(buf, len, "%Y%m%d", &tm);
+static int history_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    (void)fi;
+    HistoryFs *fs = history_fs();
+    HistoryNode node;
+    if (!history_resolve(fs, path, &node)) return -ENOENT;
+    history_fill_stat(fs, node.entry, st);
+    return 0;
 }
 
-static void backup_jobs(const std::vector<Job> &jobs, const std::vector<std::string> &rsync_extra, const RunMode &mode, const std::string &mount_prefix) {
-    for (const auto &job : jobs) {
-        bool job_locked = false;
-        std::string lock_path;
-        if (!mode.dry_run) {
-            if (!is_safe_job_name(job.name)) {
-                std::printf("job %s name must use only letters, digits, '.', '-', '_'\n", job.name.empty() ? "<unnamed>" : job.name.c_str());
-                std::exit(2);
-            }
-            lock_path = "/var/run/timevault." + job.name + ".pid";
-            int lock_rc = lock_file_path(lock_path);
-            if (lock_rc == 0) {
-                std::printf("job %s is already running\n", job.name.c_str());
-                std::exit(3);
-            }
-            if (lock_rc < 0) {
-                std::printf("failed to lock %s: %s (need write permission; try sudo or adjust permissions)\n", lock_path.c_str(), std::strerror(errno));
-                std::exit(2);
-            }
-            job_locked = true;
+static int history_readlink(const char *path, char *buf, size_t size) {
+    HistoryNode node;
+    if (!history_resolve(history_fs(), path, &node) || !node.snapshot) return -ENOENT;
+    if (!S_ISLNK(node.entry.mode)) return -EINVAL;
+    ssize_t n = readlink(history_real_path(node).c_str(), buf, size - 1);
+    if (n < 0) return -errno;
+    buf[n] = '\0';
+    return 0;
+}
+
+static int history_open(const char *path, struct fuse_file_info *fi) {
+    HistoryNode node;
+    if (!history_resolve(history_fs(), path, &node)) return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    if (!node.snapshot || !S_ISREG(node.entry.mode)) return -EISDIR;
+    int fd = ::open(history_real_path(node).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    fi->fh = static_cast<uint64_t>(fd);
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int history_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void)path;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(static_cast<int>(fi->fh), buf + done, size - done, offset + static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return done > 0 ? static_cast<int>(done) : -errno;
+        if (n == 0) break;
+        done += static_cast<size_t>(n);
+    }
+    return static_cast<int>(done);
+}
+
+static int history_release(const char *path, struct fuse_file_info *fi) {
+    (void)path;
+    ::close(static_cast<int>(fi->fh));
+    return 0;
+}
+
+static int history_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                           struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    (void)offset;
+    (void)fi;
+    HistoryFs *fs = history_fs();
+    HistoryNode node;
+    if (!history_resolve(fs, path, &node)) return -ENOENT;
+    if (!S_ISDIR(node.entry.mode)) return -ENOTDIR;
+    fuse_fill_dir_flags fill = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : static_cast<fuse_fill_dir_flags>(0);
+    struct stat st;
+    history_fill_stat(fs, node.entry, &st);
+    filler(buf, ".", &st, 0, fill);
+    filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    std::string prefix = node.rel.empty() ? "" : node.rel + "/";
+    ManifestEntry dir = history_dir_entry(fs);
+    if (node.kind == HistoryNodeKind::Root) {
+        history_fill_stat(fs, dir, &st);
+        for (const auto &job : fs->jobs) filler(buf, job.name.c_str(), &st, 0, fill);
+    } else if (node.kind == HistoryNodeKind::Job) {
+        history_fill_stat(fs, dir, &st);
+        filler(buf, HISTORY_VERSIONS, &st, 0, fill);
+        for (const auto &snap : node.job->snapshots) {
+            ManifestEntry e;
+            if (!history_lookup(fs, snap, "", &e)) continue;
+            history_fill_stat(fs, e, &st);
+            filler(buf, snap.name.c_str(), &st, 0, fill);
         }
-        if (mode.verbose) {
-            const char *policy = job.run_policy == RunPolicy::Auto ? "auto" : (job.run_policy == RunPolicy::Demand ? "demand" : "off");
-            std::printf("job: %s\n", job.name.c_str());
-            std::printf("  run: %s\n", policy);
-            std::printf("  source: %s\n", job.source.c_str());
-            std::printf("  dest: %s\n", job.dest.c_str());
-            std::printf("  mount: %s\n", job.mount.empty() ? "<unset>" : job.mount.c_str());
-            std::printf("  copies: %d\n", job.copies);
-            std::printf("  excludes: %zu\n", job.excludes.size());
-        }
-
-        const char *home = getenv("HOME");
-        if (!home) home = "/tmp";
-        char tmp_dir[PATH_MAX];
-        std::snprintf(tmp_dir, sizeof(tmp_dir), "%s/tmp", home);
-        if (!mode.dry_run) {
-            mkdir(tmp_dir, 0755);
-        }
-        char excludes_path[PATH_MAX];
-        std::snprintf(excludes_path, sizeof(excludes_path), "%s/timevault.excludes", tmp_dir);
-        if (mode.dry_run) {
-            std::printf("dry-run: would write excludes file %s\n", excludes_path);
-        } else {
-            create_excludes_file(job, excludes_path);
+    } else if (node.kind == HistoryNodeKind::Path) {
+        std::vector<ManifestEntry> children;
+        history_list(fs, *node.snapshot, node.rel, &children);
+        for (const auto &e : children) {
+            history_fill_stat(fs, e, &st);
+            filler(buf, e.path.c_str() + prefix.size(), &st, 0, fill);
         }
-
-        time_t now = time(nullptr) - 86400;
-        char backup_day[32];
-        format_day(backup_day, sizeof(backup_day), now);
-        if (mode.verbose) {
-            std::printf("  backup day: %s\n", backup_day);
+    } else if (node.kind == HistoryNodeKind::Versions) {
+        // Newer snapshots win, so a name shows as it was last seen.
+        std::map<std::string, ManifestEntry> names;
+        std::vector<ManifestEntry> children;
+        for (const auto &snap : node.job->snapshots) {
+            history_list(fs, snap, node.rel, &children);
+            for (auto &e : children) names[e.path.substr(prefix.size())] = std::move(e);
+        }
+        for (const auto &n : names) {
+            history_fill_stat(fs, S_ISDIR(n.second.mode) ? n.second : dir, &st);
+            filler(buf, n.first.c_str(), &st, 0, fill);
         }
+    } else if (node.kind == HistoryNodeKind::VersionList) {
+        std::vector<std::pair<const HistorySnapshot *, ManifestEntry>> versions;
+        history_versions(fs, *node.job, node.rel, &versions);
+        for (const auto &v : versions) {
+            history_fill_stat(fs, v.second, &st);
+            filler(buf, v.first->name.c_str(), &st, 0, fill);
+        }
+    }
+    return 0;
+}
+
+static void history_load_job(const Job &job, uint64_t *next_id, HistoryJob *out) {
+    out->name = job.name;
+    std::vector<std::string> names;
+    list_snapshots(job.dest, &names);
+    std::sort(names.begin(), names.end());
+    out->snapshots.resize(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        HistorySnapshot &snap = out->snapshots[i];
+        snap.id = (*next_id)++;
+        snap.name = names[i];
+        snap.root = job.dest + "/" + names[i];
+        std::string err;
+        snap.indexed = manifest_open(manifest_path(job.dest, names[i]), &snap.view, &err);
+    }
+}
 
-        if (job.mount.empty()) {
-            std::printf("skip job %s: mount is required for all jobs\n", job.name.c_str());
-            if (job_locked) unlock_file_path(lock_path);
+static int run_history_mount(const std::vector<Job> &jobs, const Config &cfg, const std::string &mountpoint, const RunMode &mode) {
+    for (const auto &job : jobs) mount_session_expect(job.mount);
+    HistoryFs fs;
+    fs.uid = getuid();
+    fs.gid = getgid();
+    fs.started = std::time(nullptr);
+    std::vector<const Job *> acquired;
+    uint64_t next_id = 1;
+    size_t snapshots = 0;
+    size_t unindexed = 0;
+    int exit_code = 0;
+    for (const auto &job : jobs) {
+        JobMetrics job_metrics;
+        std::string err;
+        if (!mount_session_acquire(job, mode, &job_metrics, &err, true)) {
+            std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
+            mount_session_finish(job.mount, mode);
+            exit_code = 1;
             continue;
         }
-        std::string err;
-        if (!ensure_unmounted(job.mount, mode, &err)) {
+        acquired.push_back(&job);
+        if (!verify_destination(job, cfg.mount_prefix, &err)) {
             std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
-            if (job_locked) unlock_file_path(lock_path);
+            exit_code = 1;
             continue;
         }
-        run_command({"mount", job.mount}, mode);
-        if (mount_is_mounted(job.mount)) {
-            track_mount(job.mount);
+        fs.jobs.emplace_back();
+        history_load_job(job, &next_id, &fs.jobs.back());
+        for (const auto &snap : fs.jobs.back().snapshots) {
+            snapshots++;
+            if (!snap.indexed) unindexed++;
         }
-        run_command({"mount", "-oremount,rw", job.mount}, mode);
+    }
 
-        int ro = mount_is_readonly(job.mount);
-        if (ro != 0) {
-            if (ro < 0) {
-                std::printf("skip job %s: mount %s is not mounted\n", job.name.c_str(), job.mount.c_str());
-            } else {
-                std::printf("skip job %s: mount %s is read-only\n", job.name.c_str(), job.mount.c_str());
-            }
-            run_command({"mount", "-oremount,ro", job.mount}, mode);
-            run_command({"umount", job.mount}, mode);
-            untrack_mount(job.mount);
-            if (job_locked) unlock_file_path(lock_path);
-            continue;
-        }
+    if (!fs.jobs.empty()) {
+        std::printf("serving %zu job(s), %zu snapshot(s) (%zu without manifest) at %s\n",
+            fs.jobs.size(), snapshots, unindexed, mountpoint.c_str());
+        std::fflush(stdout);
+    }
+    if (!fs.jobs.empty() && !mode.dry_run) {
+        struct fuse_operations ops;
+        std::memset(&ops, 0, sizeof(ops));
+        ops.init = history_init;
+        ops.getattr = history_getattr;
+        ops.readlink = history_readlink;
+        ops.open = history_open;
+        ops.read = history_read;
+        ops.release = history_release;
+        ops.readdir = history_readdir;
+        std::string target = mountpoint;
+        std::vector<char *> args = {const_cast<char *>("timevault"), const_cast<char *>("-f"),
+            const_cast<char *>("-o"), const_cast<char *>("ro,default_permissions,fsname=timevault"), &target[0]};
+        // libfuse's handlers unmount and return; signal_watch would leave
+        // the mount behind, so let them reach this thread instead.
+        sigset_t stop = watched_signals();
+        sigdelset(&stop, SIGHUP);
+        pthread_sigmask(SIG_UNBLOCK, &stop, nullptr);
+        if (fuse_main(static_cast<int>(args.size()), args.data(), &ops, &fs) != 0) exit_code = 1;
+        pthread_sigmask(SIG_BLOCK, &stop, nullptr);
+    }
 
-        if (!verify_destination(job, mount_prefix, &err)) {
-            std::printf("skip job %s: %s\n", job.name.c_str(), err.c_str());
-            run_command({"mount", "-oremount,ro", job.mount}, mode);
-            run_command({"umount", job.mount}, mode);
-            untrack_mount(job.mount);
-            if (job_locked) unlock_file_path(lock_path);
-            continue;
+    for (auto &job : fs.jobs) {
+        for (auto &snap : job.snapshots) {
+            if (snap.indexed) manifest_close(&snap.view);
         }
+    }
+    for (const Job *job : acquired) {
+        mount_session_release(job->mount, mode);
+        mount_session_finish(job->mount, mode);
+    }
+    return exit_code;
+}
+#else
+static int run_history_mount(const std::vector<Job> &jobs, const Config &cfg, const std::string &mountpoint, const RunMode &mode) {
+    (void)jobs;
+    (void)cfg;
+    (void)mountpoint;
+    (void)mode;
+    std::printf("--history-mount needs a build with -DTIMEVAULT_WITH_FUSE and fuse3\n");
+    return 2;
+}
+#endif
 
-        expire_old_backups(job, job.dest, mode);
+// --sandbox runs everything inside a private mount namespace (and a user
+// namespace when not root), with lock, history and runtime files under the
+// sandbox directory and a private fstab bound over /etc/fstab. Without a
+// <dir>/fstab, each job mount gets a tmpfs store that is bind-mounted
+// through the usual mount/remount/umount path; tmpfs superblocks belong to
+// the namespace, so that works unprivileged. A <dir>/fstab is used as is
+// (loop images need real root). <dir>/seed/diskN, if present, is copied
+// into the Nth tmpfs store before the run.
+static std::string sandbox_dir;
+static std::string sandbox_lock_dir;
+static std::string sandbox_lock_file;
+static std::string sandbox_history;
+static std::string sandbox_runtime_dir;
 
-        std::string current_path = job.dest + "/current";
-        std::string backup_dir = job.dest + "/" + backup_day;
-        struct stat st;
-        if (stat(current_path.c_str(), &st) == 0 && access(backup_dir.c_str(), F_OK) != 0) {
-            if (mode.dry_run) {
-                std::printf("dry-run: mkdir -p %s\n", backup_dir.c_str());
-            } else {
-                mkdir(backup_dir.c_str(), 0755);
-            }
-            std::string cp_src = current_path + "/.";
-            run_nice_ionice({"cp", "-ralf", cp_src, backup_dir}, mode);
-            if (mode.safe_mode || mode.dry_run) {
-                if (mode.dry_run) {
-                    std::printf("dry-run: find %s -type l -delete\n", backup_dir.c_str());
-                } else {
-                    std::printf("skip symlink cleanup (safe-mode): %s\n", backup_dir.c_str());
-                }
-            } else {
-                delete_symlinks(backup_dir);
-            }
-        }
+static bool write_proc_file(const std::string &path, const std::string &text, std::string *err) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || !write_all(fd, text.data(), text.size())) {
+        *err = "cannot write " + path + ": " + std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    ::close(fd);
+    return true;
+}
 
-        std::vector<std::string> rsync_args = {"rsync", "-ar", "--stats", std::string("--exclude-from=") + excludes_path};
-        if (!mode.safe_mode) {
-            rsync_args.push_back("--delete-after");
-            rsync_args.push_back("--delete-excluded");
-        }
-        for (const auto &arg : rsync_extra) rsync_args.push_back(arg);
-        rsync_args.push_back(job.source);
-        rsync_args.push_back(backup_dir);
+static bool make_dirs(const std::string &path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos < path.size() && path[pos] != '/') continue;
+        std::string part = path.substr(0, pos);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
 
-        int rc = 1;
-        for (int i = 0; i < 3; i++) {
-            rc = run_nice_ionice(rsync_args, mode);
-        }
+static bool sandbox_enter(const std::string &dir, std::string *err) {
+    char real[PATH_MAX];
+    if (!make_dirs(dir) || !realpath(dir.c_str(), real)) {
+        *err = "cannot create " + dir + ": " + std::strerror(errno);
+        return false;
+    }
+    sandbox_dir = real;
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    bool user_ns = geteuid() != 0;
+    if (unshare(CLONE_NEWNS | (user_ns ? CLONE_NEWUSER : 0)) != 0) {
+        *err = std::string("unshare failed: ") + std::strerror(errno);
+        return false;
+    }
+    if (user_ns) {
+        if (!write_proc_file("/proc/self/setgroups", "deny", err)) return false;
+        if (!write_proc_file("/proc/self/uid_map", "0 " + std::to_string(uid) + " 1", err)) return false;
+        if (!write_proc_file("/proc/self/gid_map", "0 " + std::to_string(gid) + " 1", err)) return false;
+    }
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0) {
+        *err = std::string("cannot make mounts private: ") + std::strerror(errno);
+        return false;
+    }
+    sandbox_lock_dir = sandbox_dir + "/run";
+    sandbox_lock_file = sandbox_lock_dir + "/timevault.pid";
+    sandbox_history = sandbox_dir + "/history";
+    sandbox_runtime_dir = sandbox_dir + "/run/timevault";
+    if (!make_dirs(sandbox_lock_dir)) {
+        *err = "cannot create " + sandbox_lock_dir + ": " + std::strerror(errno);
+        return false;
+    }
+    LOCK_DIR = sandbox_lock_dir.c_str();
+    LOCK_FILE = sandbox_lock_file.c_str();
+    DEFAULT_HISTORY = sandbox_history.c_str();
+    DEFAULT_RUNTIME_DIR = sandbox_runtime_dir.c_str();
+    return true;
+}
 
-        if (rc == 0 && access(backup_dir.c_str(), F_OK) == 0) {
-            std::string current_link = job.dest + "/current";
-            struct stat lstat_buf;
-            if (lstat(current_link.c_str(), &lstat_buf) == 0) {
-                if (S_ISLNK(lstat_buf.st_mode) || S_ISREG(lstat_buf.st_mode)) {
-                    if (mode.safe_mode || mode.dry_run) {
-                        if (mode.dry_run) {
-                            std::printf("dry-run: rm -f %s\n", current_link.c_str());
-                        } else {
-                            std::printf("skip remove (safe-mode): %s\n", current_link.c_str());
-                        }
-                    } else {
-                        unlink(current_link.c_str());
-                    }
-                } else if (S_ISDIR(lstat_buf.st_mode)) {
-                    std::printf("skip updating current (directory exists): %s\n", current_link.c_str());
-                }
+static bool sandbox_prepare_mounts(const Config &cfg, const RunMode &mode, std::string *err) {
+    std::string fstab = sandbox_dir + "/fstab";
+    if (access(fstab.c_str(), F_OK) != 0) {
+        fstab = sandbox_dir + "/fstab.sandbox";
+        std::string text;
+        std::unordered_map<std::string, std::string> stores;
+        for (const auto &job : cfg.jobs) {
+            if (job.mount.empty() && executor.mode == ExecutorMode::Replay) {
+                *err = "job " + job.name + " has no mount; replay only writes to sandbox tmpfs mounts";
+                return false;
             }
-            if (access(current_link.c_str(), F_OK) != 0) {
-                if (mode.dry_run) {
-                    std::printf("dry-run: ln -s %s %s\n", backup_day, current_link.c_str());
-                } else {
-                    symlink(backup_day, current_link.c_str());
+            if (job.mount.empty()) continue;
+            auto it = stores.find(job.mount);
+            if (it == stores.end()) {
+                // Replayed mount commands never run, so the tmpfs goes
+                // straight onto the mount point.
+                std::string store = executor.mode == ExecutorMode::Replay
+                    ? job.mount : sandbox_dir + "/disks/disk" + std::to_string(stores.size());
+                if (!make_dirs(store) || !make_dirs(job.mount)) {
+                    *err = "cannot create " + store + " or " + job.mount + ": " + std::strerror(errno);
+                    return false;
+                }
+                if (mount("timevault", store.c_str(), "tmpfs", 0, "mode=0755") != 0) {
+                    *err = "cannot mount tmpfs on " + store + ": " + std::strerror(errno);
+                    return false;
+                }
+                // Not seeded under --record/--replay, which would log or
+                // skip the copy.
+                std::string seed = sandbox_dir + "/seed/disk" + std::to_string(stores.size());
+                if (executor.mode == ExecutorMode::Real && access(seed.c_str(), F_OK) == 0 &&
+                    run_command({"cp", "-a", seed + "/.", store}, mode) != 0) {
+                    *err = "cannot copy " + seed + " to " + store;
+                    return false;
+                }
+                std::string marker = store + "/" + TIMEVAULT_MARKER;
+                int fd = ::open(marker.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    *err = "cannot create " + marker + ": " + std::strerror(errno);
+                    return false;
                 }
+                ::close(fd);
+                text += store + " " + job.mount + " none bind 0 0\n";
+                if (mode.verbose) {
+                    std::printf("sandbox: %s -> tmpfs %s\n", job.mount.c_str(), store.c_str());
+                }
+                it = stores.emplace(job.mount, store).first;
+            }
+            // What --init and the operator would have created on a real disk.
+            if (job.dest.compare(0, job.mount.size() + 1, job.mount + "/") == 0) {
+                make_dirs(it->second + job.dest.substr(job.mount.size()));
             }
         }
-
-        run_command({"mount", "-oremount,ro", job.mount}, mode);
-        run_command({"umount", job.mount}, mode);
-        untrack_mount(job.mount);
-        if (job_locked) unlock_file_path(lock_path);
+        int fd = ::open(fstab.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write_all(fd, text.data(), text.size());
+        if (fd >= 0) ::close(fd);
+        if (!ok) {
+            *err = "cannot write " + fstab + ": " + std::strerror(errno);
+            return false;
+        }
+    }
+    if (mount(fstab.c_str(), "/etc/fstab", nullptr, MS_BIND, nullptr) != 0) {
+        *err = "cannot bind " + fstab + " over /etc/fstab: " + std::strerror(errno);
+        return false;
     }
+    return true;
 }
 
+// Benchmarks include this file with TIMEVAULT_NO_MAIN to reuse its internals.
+#ifndef TIMEVAULT_NO_MAIN
 int main(int argc, char **argv) {
     RunMode mode;
     std::string config_path = DEFAULT_CONFIG;
@@ -1057,13 +6130,30 @@ int main(int argc, char **argv) {
     std::vector<std::string> rsync_extra;
     std::vector<std::string> selected_jobs;
     bool print_order = false;
+    bool compile_config = false;
     bool show_version = false;
     bool have_lock = false;
     bool rsync_passthrough = false;
+    RunMetrics metrics;
+    int max_parallel = 0;
+    bool use_config_cache = true;
+    bool daemon = false;
+    RunOutputs outputs;
+    std::vector<std::string> ctl_args;
+    bool ctl_mode = false;
+    std::string sandbox;
+    std::string search;
+    bool space = false;
+    bool space_full = false;
+    std::string restore;
+    std::string restore_to;
+    std::string history_mount;
+    ExecutorMode executor_mode = ExecutorMode::Real;
+    std::string command_log;
+    double replay_speed = 1.0;
 
     std::atexit(cleanup_mounts);
-    std::signal(SIGINT, handle_signal);
-    std::signal(SIGTERM, handle_signal);
+    signals_block();
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -1071,6 +6161,10 @@ int main(int argc, char **argv) {
             rsync_extra.push_back(arg);
             continue;
         }
+        if (ctl_mode) {
+            ctl_args.push_back(arg);
+            continue;
+        }
         if (arg == "--backup") {
             continue;
         } else if (arg == "--dry-run") {
@@ -1108,8 +6202,123 @@ int main(int argc, char **argv) {
                 return 2;
             }
             selected_jobs.push_back(argv[++i]);
+        } else if (arg == "--lock-wait") {
+            if (i + 1 >= argc) {
+                std::printf("--lock-wait requires seconds (-1 waits forever)\n");
+                return 2;
+            }
+            char *end = nullptr;
+            long v = std::strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || v < -1 || v > INT_MAX) {
+                std::printf("--lock-wait requires seconds (-1 waits forever)\n");
+                return 2;
+            }
+            mode.lock_wait_sec = static_cast<int>(v);
+        } else if (arg == "--parallel") {
+            if (i + 1 >= argc) {
+                std::printf("--parallel requires a job count\n");
+                return 2;
+            }
+            char *end = nullptr;
+            long v = std::strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || v < 1 || v > 1024) {
+                std::printf("--parallel requires a job count between 1 and 1024\n");
+                return 2;
+            }
+            max_parallel = static_cast<int>(v);
+        } else if (arg == "--schedule") {
+            if (i + 1 >= argc) {
+                std::printf("--schedule requires critical-path, longest-first or config-order\n");
+                return 2;
+            }
+            std::string policy = argv[++i];
+            if (policy == "critical-path") {
+                mode.schedule = SchedulePolicy::CriticalPath;
+            } else if (policy == "longest-first") {
+                mode.schedule = SchedulePolicy::LongestFirst;
+            } else if (policy == "config-order") {
+                mode.schedule = SchedulePolicy::ConfigOrder;
+            } else {
+                std::printf("--schedule requires critical-path, longest-first or config-order\n");
+                return 2;
+            }
+        } else if (arg == "--no-config-cache") {
+            use_config_cache = false;
         } else if (arg == "--print-order") {
             print_order = true;
+        } else if (arg == "--compile-config") {
+            compile_config = true;
+        } else if (arg == "--daemon") {
+            daemon = true;
+        } else if (arg == "--report-json") {
+            if (i + 1 >= argc) {
+                std::printf("--report-json requires a path\n");
+                return 2;
+            }
+            outputs.report_json = argv[++i];
+        } else if (arg == "--trace") {
+            if (i + 1 >= argc) {
+                std::printf("--trace requires a path\n");
+                return 2;
+            }
+            outputs.trace = argv[++i];
+        } else if (arg == "--record" || arg == "--replay") {
+            if (i + 1 >= argc) {
+                std::printf("%s requires a command log path\n", arg.c_str());
+                return 2;
+            }
+            if (executor_mode != ExecutorMode::Real) {
+                std::printf("use only one of --record or --replay\n");
+                return 2;
+            }
+            executor_mode = arg == "--record" ? ExecutorMode::Record : ExecutorMode::Replay;
+            command_log = argv[++i];
+        } else if (arg == "--replay-speed") {
+            char *end = nullptr;
+            double v = i + 1 < argc ? std::strtod(argv[++i], &end) : -1.0;
+            if (!end || *end != '\0' || v < 0.0) {
+                std::printf("--replay-speed requires a factor (0 skips recorded delays)\n");
+                return 2;
+            }
+            replay_speed = v;
+        } else if (arg == "--search") {
+            if (i + 1 >= argc) {
+                std::printf("--search requires a path or glob\n");
+                return 2;
+            }
+            search = argv[++i];
+        } else if (arg == "--restore") {
+            if (i + 1 >= argc) {
+                std::printf("--restore requires <snapshot>[/<path>]\n");
+                return 2;
+            }
+            restore = argv[++i];
+        } else if (arg == "--restore-to") {
+            if (i + 1 >= argc) {
+                std::printf("--restore-to requires a target directory\n");
+                return 2;
+            }
+            restore_to = argv[++i];
+            while (restore_to.size() > 1 && restore_to.back() == '/') restore_to.pop_back();
+        } else if (arg == "--history-mount") {
+            if (i + 1 >= argc) {
+                std::printf("--history-mount requires a mount point\n");
+                return 2;
+            }
+            history_mount = argv[++i];
+        } else if (arg == "--space") {
+            space = true;
+        } else if (arg == "--space-full") {
+            space = true;
+            space_full = true;
+        } else if (arg == "--sandbox") {
+            if (i + 1 >= argc) {
+                std::printf("--sandbox requires a directory\n");
+                return 2;
+            }
+            sandbox = argv[++i];
+        } else if (arg == "--ctl") {
+            ctl_mode = true;
         } else if (arg == "--version") {
             show_version = true;
         } else if (arg == "--rsync") {
@@ -1122,6 +6331,72 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (executor_mode == ExecutorMode::Replay && sandbox.empty()) {
+        std::printf("--replay requires --sandbox, so the replayed run cannot touch real disks\n");
+        return 2;
+    }
+    if (executor_mode != ExecutorMode::Real) {
+        std::string err;
+        if (!executor_open(executor_mode, command_log, replay_speed, &err)) {
+            std::printf("%s\n", err.c_str());
+            return 2;
+        }
+    }
+
+    if (!sandbox.empty()) {
+        if (ctl_mode || daemon) {
+            std::printf("--sandbox cannot be combined with --ctl or --daemon\n");
+            return 2;
+        }
+        std::string err;
+        if (!sandbox_enter(sandbox, &err)) {
+            std::printf("sandbox failed: %s\n", err.c_str());
+            return 2;
+        }
+    }
+    signals_watch();
+
+    if (ctl_mode) {
+        if (ctl_args.empty()) {
+            std::printf("--ctl requires a command (enqueue, list, status, timings or cancel)\n");
+            return 2;
+        }
+        Config cfg;
+        JobGraph graph;
+        std::vector<int> config_order;
+        std::string err;
+        if (!load_config(config_path, mode, use_config_cache, &cfg, &graph, &config_order, &err, false)) {
+            std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
+            return 2;
+        }
+        return control_client(control_socket_path(cfg), ctl_args);
+    }
+
+    // Writes <config>.cache ahead of time, since read-only commands
+    // (--print-order, --ctl) never do.
+    if (compile_config) {
+        if (!use_config_cache || mode.dry_run) {
+            std::printf("--compile-config cannot be combined with --no-config-cache or --dry-run\n");
+            return 2;
+        }
+        Config cfg;
+        JobGraph graph;
+        std::vector<int> config_order;
+        std::string err;
+        if (!load_config(config_path, mode, true, &cfg, &graph, &config_order, &err)) {
+            std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
+            return 2;
+        }
+        std::string cache_path = config_cache_path(config_path);
+        struct stat st;
+        if (::stat(cache_path.c_str(), &st) != 0) {
+            std::printf("could not write compiled config %s\n", cache_path.c_str());
+            return 1;
+        }
+        std::printf("compiled config %s (%zu jobs)\n", cache_path.c_str(), cfg.jobs.size());
+        return 0;
+    }
+
     print_banner();
     if (show_version) {
         print_copyright();
@@ -1130,13 +6405,27 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (!outputs.trace.empty()) {
+        trace_enabled = true;
+        trace_started = monotonic_seconds();
+        trace_thread_name("main");
+    }
+
+    if (daemon) {
+        if (!init_mount.empty() || !selected_jobs.empty() || print_order) {
+            std::printf("--daemon cannot be combined with --init, --job or --print-order\n");
+            return 2;
+        }
+        return run_daemon(config_path, rsync_extra, mode, max_parallel, use_config_cache, outputs);
+    }
+
     char timebuf[64];
     format_time(timebuf, sizeof(timebuf), std::time(nullptr));
     std::printf("%s\n", timebuf);
 
     if (!init_mount.empty()) {
         if (!mode.dry_run && !print_order) {
-            int lock_rc = lock_file();
+            int lock_rc = lock_file(mode.lock_wait_sec, &metrics.lock_wait_sec);
             if (lock_rc == 0) {
                 std::printf("timevault is already running\n");
                 return 3;
@@ -1158,12 +6447,28 @@ int main(int argc, char **argv) {
             }
             mount_prefix = cfg.mount_prefix;
         }
+        FileLock mount_lock;
+        if (have_lock) {
+            std::string lock_path = mount_lock_path(init_mount);
+            int lock_rc = lock_acquire(lock_path, mode.lock_wait_sec, &mount_lock, nullptr);
+            if (lock_rc != 1) {
+                if (lock_rc == 0) {
+                    std::printf("mount %s is in use by another timevault run\n", init_mount.c_str());
+                } else {
+                    std::printf("failed to lock %s: %s (need write permission; try sudo or adjust permissions)\n", lock_path.c_str(), std::strerror(errno));
+                }
+                unlock_file();
+                return lock_rc == 0 ? 3 : 2;
+            }
+        }
         if (!init_timevault(init_mount, mount_prefix, mode, force_init, &err)) {
             std::printf("init failed: %s\n", err.c_str());
+            lock_release(&mount_lock);
             if (have_lock) unlock_file();
             return 2;
         }
         std::printf("initialized timevault at %s\n", init_mount.c_str());
+        lock_release(&mount_lock);
         if (have_lock) unlock_file();
         format_time(timebuf, sizeof(timebuf), std::time(nullptr));
         std::printf("%s\n", timebuf);
@@ -1172,24 +6477,56 @@ int main(int argc, char **argv) {
 
     Config cfg;
     std::string err;
-    if (!parse_config(config_path, &cfg, &err)) {
+    JobGraph graph;
+    std::vector<int> config_order;
+    double load_started = monotonic_seconds();
+    if (!load_config(config_path, mode, use_config_cache, &cfg, &graph, &config_order, &err, !print_order)) {
         std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
         if (have_lock) unlock_file();
         return 2;
     }
-    if (!validate_job_names(cfg, &err)) {
-        std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
-        if (have_lock) unlock_file();
+    trace_event("load config", "config", load_started, {{"path", config_path}});
+    if (!sandbox_dir.empty() && !print_order && !sandbox_prepare_mounts(cfg, mode, &err)) {
+        std::printf("sandbox failed: %s\n", err.c_str());
         return 2;
     }
-    if (!cfg.jobs.empty()) {
-        std::vector<int> all_included(cfg.jobs.size(), 1);
-        std::vector<Job> ordered;
-        if (!topo_sort_jobs(cfg, all_included, &ordered, &err)) {
-            std::printf("failed to load config %s: %s\n", config_path.c_str(), err.c_str());
-            if (have_lock) unlock_file();
+    if (!sandbox_dir.empty()) {
+        // Paths set in the config would otherwise escape the sandbox.
+        cfg.history_path = sandbox_history;
+        cfg.runtime_dir = sandbox_runtime_dir;
+        if (!cfg.prometheus_textfile.empty()) cfg.prometheus_textfile = sandbox_dir + "/timevault.prom";
+    }
+
+    if (!restore.empty() || !restore_to.empty()) {
+        if (restore.empty() || restore_to.empty() || selected_jobs.size() != 1) {
+            std::printf("--restore requires --restore-to and exactly one --job\n");
+            return 2;
+        }
+        auto it = std::find_if(cfg.jobs.begin(), cfg.jobs.end(), [&](const Job &job) {
+            return job.name == selected_jobs[0];
+        });
+        if (it == cfg.jobs.end() || it->mount.empty()) {
+            std::printf("job %s not found or has no mount\n", selected_jobs[0].c_str());
+            return 2;
+        }
+        return run_restore({*it}, cfg, restore, restore_to, max_parallel, mode);
+    }
+
+    if (!search.empty() || space || !history_mount.empty()) {
+        std::vector<Job> search_jobs;
+        for (const auto &job : cfg.jobs) {
+            bool selected = selected_jobs.empty()
+                ? job.run_policy != RunPolicy::Off
+                : std::find(selected_jobs.begin(), selected_jobs.end(), job.name) != selected_jobs.end();
+            if (selected && !job.mount.empty()) search_jobs.push_back(job);
+        }
+        if (search_jobs.empty()) {
+            std::printf("no jobs matched selection; aborting\n");
             return 2;
         }
+        if (!history_mount.empty()) return run_history_mount(search_jobs, cfg, history_mount, mode);
+        if (space) return run_space(search_jobs, cfg, space_full, mode);
+        return run_search(search_jobs, cfg, search, mode);
     }
 
     std::vector<std::string> roots;
@@ -1209,7 +6546,7 @@ int main(int argc, char **argv) {
     }
     std::vector<int> included(cfg.jobs.size(), 0);
     err.clear();
-    if (!collect_jobs_with_deps(cfg, roots, &included, &err)) {
+    if (!collect_jobs_with_deps(cfg, graph, roots, &included, &err)) {
         if (err.rfind("job not found:", 0) == 0) {
             std::printf("%s\n", err.c_str());
             std::printf("no such job(s) found; aborting\n");
@@ -1222,11 +6559,10 @@ int main(int argc, char **argv) {
         if (have_lock) unlock_file();
         return 2;
     }
+    // config_order is load_config's dependency sort of every job.
     std::vector<Job> jobs_to_run;
-    if (!topo_sort_jobs(cfg, included, &jobs_to_run, &err)) {
-        std::printf("dependency order failed: %s\n", err.c_str());
-        if (have_lock) unlock_file();
-        return 2;
+    for (int idx : config_order) {
+        if (included[idx]) jobs_to_run.push_back(cfg.jobs[idx]);
     }
 
     if (jobs_to_run.empty()) {
@@ -1238,10 +6574,20 @@ int main(int argc, char **argv) {
         if (have_lock) unlock_file();
         return 2;
     }
+    JobHistory history;
+    load_job_history(cfg.history_path, &history);
+    JobPlan plan;
+    build_job_plan(jobs_to_run, effective_limits(cfg, max_parallel, !print_order), history, mode.schedule, &plan);
+    if (print_order || mode.verbose) {
+        std::vector<int> dependency_order(jobs_to_run.size());
+        for (size_t i = 0; i < jobs_to_run.size(); i++) dependency_order[i] = static_cast<int>(i);
+        int predicted = count_mount_transitions(jobs_to_run, predict_schedule(plan).order);
+        int baseline = count_mount_transitions(jobs_to_run, dependency_order);
+        std::printf("mount transitions: %d predicted (dependency order: %d, saved: %d)\n",
+            predicted, baseline, baseline - predicted);
+    }
     if (print_order) {
-        for (const auto &job : jobs_to_run) {
-            print_job_details(job);
-        }
+        print_predicted_order(jobs_to_run, cfg, plan);
         if (have_lock) unlock_file();
         return 0;
     }
@@ -1253,13 +6599,25 @@ int main(int argc, char **argv) {
         }
     }
 
-    backup_jobs(jobs_to_run, rsync_extra, mode, cfg.mount_prefix);
+    int exit_code = backup_jobs(jobs_to_run, rsync_extra, mode, cfg, plan, &history, &metrics);
+    if (!mode.dry_run) {
+        compact_job_history(cfg.history_path, history);
+    }
 
     if (have_lock) unlock_file();
     if (!mode.dry_run) {
+        double t = phase_begin("sync");
         run_command({"sync"}, mode);
+        phase_end("sync", t);
     }
+    collect_job_status(&metrics);
+    print_run_metrics(metrics, mode);
+    if (executor.mode == ExecutorMode::Replay) {
+        std::printf("replay: %ld exact, %ld by shape, %ld unmatched\n", executor.exact, executor.shaped, executor.missed);
+    }
+    write_run_outputs(outputs, metrics, exit_code, mode);
     format_time(timebuf, sizeof(timebuf), std::time(nullptr));
     std::printf("%s\n", timebuf);
-    return 0;
+    return exit_code;
 }
+#endif
@@ -0,0 +1,396 @@
+// Phase benchmark for the legacy C++ binary: generates a reproducible
+// synthetic snapshot tree and times clone, symlink cleanup, expiry and sync
+// with the same code paths backup_job uses.
+//
+//   g++ -std=c++17 -O2 -pthread legacy/timevault_bench.cpp -lyaml-cpp -lz -o /tmp/timevault_bench
+//   /tmp/timevault_bench --files 20000 --iterations 3 --format csv > bench.csv
+
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#define TIMEVAULT_NO_MAIN
+#include "timevault.cpp"
+
+struct TreeSpec {
+    long files = 10000;
+    long long min_size = 0;
+    long long max_size = 64 * 1024;
+    int depth = 3;
+    int fanout = 8;
+    double hardlink_ratio = 0.05;
+    double symlink_ratio = 0.02;
+    uint64_t seed = 1;
+};
+
+struct TreeStats {
+    long files = 0;
+    long hardlinks = 0;
+    long symlinks = 0;
+    long dirs = 0;
+    long long bytes = 0;
+};
+
+struct BenchResult {
+    std::string mode;
+    std::string phase;
+    int iteration = 0;
+    double seconds = 0.0;
+    long long bytes_reclaimed = 0;
+};
+
+static uint64_t bench_rand(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double bench_uniform(uint64_t *state) {
+    return static_cast<double>(bench_rand(state) >> 11) / static_cast<double>(1ULL << 53);
+}
+
+// Sizes are log-uniform between min and max, so most files are small and a
+// few are large, roughly like a real filesystem.
+static long long bench_size(const TreeSpec &spec, uint64_t *state) {
+    if (spec.max_size <= spec.min_size) return spec.min_size;
+    double lo = std::log(static_cast<double>(spec.min_size) + 1.0);
+    double hi = std::log(static_cast<double>(spec.max_size) + 1.0);
+    return static_cast<long long>(std::exp(lo + (hi - lo) * bench_uniform(state))) - 1;
+}
+
+static bool write_file(const std::string &path, long long size, uint64_t *state) {
+    int fd = ::open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    char buf[65536];
+    bool ok = true;
+    while (ok && size > 0) {
+        size_t n = static_cast<size_t>(std::min<long long>(size, sizeof(buf)));
+        // The last word may be partial; it is still drawn from the stream so
+        // every byte of the tree follows from the seed.
+        for (size_t i = 0; i < n; i += 8) {
+            uint64_t v = bench_rand(state);
+            std::memcpy(buf + i, &v, std::min<size_t>(8, n - i));
+        }
+        ok = write_all(fd, buf, n);
+        size -= static_cast<long long>(n);
+    }
+    return ::close(fd) == 0 && ok;
+}
+
+// Files are spread round-robin over a fanout^depth directory tree. A
+// hardlink or symlink points at an earlier regular file in the same tree.
+static bool generate_tree(const std::string &root, const TreeSpec &spec, TreeStats *stats) {
+    uint64_t state = spec.seed;
+    std::vector<std::string> dirs = {root};
+    if (mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    size_t level_start = 0;
+    for (int d = 0; d < spec.depth; d++) {
+        size_t level_end = dirs.size();
+        for (size_t i = level_start; i < level_end; i++) {
+            for (int k = 0; k < spec.fanout; k++) {
+                std::string dir = dirs[i] + "/d" + std::to_string(k);
+                if (mkdir(dir.c_str(), 0755) != 0) return false;
+                dirs.push_back(dir);
+                stats->dirs++;
+            }
+        }
+        level_start = level_end;
+    }
+    std::vector<std::string> regular;
+    for (long i = 0; i < spec.files; i++) {
+        std::string path = dirs[static_cast<size_t>(i) % dirs.size()] + "/f" + std::to_string(i);
+        double kind = bench_uniform(&state);
+        if (!regular.empty() && kind < spec.hardlink_ratio) {
+            const std::string &target = regular[bench_rand(&state) % regular.size()];
+            if (link(target.c_str(), path.c_str()) != 0) return false;
+            stats->hardlinks++;
+        } else if (!regular.empty() && kind < spec.hardlink_ratio + spec.symlink_ratio) {
+            const std::string &target = regular[bench_rand(&state) % regular.size()];
+            if (symlink(target.c_str(), path.c_str()) != 0) return false;
+            stats->symlinks++;
+        } else {
+            long long size = bench_size(spec, &state);
+            if (!write_file(path, size, &state)) return false;
+            regular.push_back(path);
+            stats->files++;
+            stats->bytes += size;
+        }
+    }
+    return true;
+}
+
+static bool bench_copy_snapshot(const std::string &from, const std::string &to, const RunMode &mode) {
+    return run_command({"cp", "-ral", from, to}, mode) == 0;
+}
+
+struct BenchContext {
+    std::string dir;
+    TreeSpec spec;
+    RunMode mode;
+    int snapshots = 4;
+    Job job;
+};
+
+static double timed_clone(const BenchContext &ctx, const std::string &backup_dir) {
+    double t = monotonic_seconds();
+    mkdir(backup_dir.c_str(), 0755);
+    run_nice_ionice({"cp", "-ralf", ctx.job.dest + "/current/.", backup_dir}, ctx.mode);
+    return monotonic_seconds() - t;
+}
+
+static double timed_symlink_cleanup(const std::string &backup_dir) {
+    double t = monotonic_seconds();
+    delete_symlinks(backup_dir);
+    return monotonic_seconds() - t;
+}
+
+static double timed_expire(const BenchContext &ctx, int copies, JobMetrics *metrics) {
+    Job job = ctx.job;
+    job.copies = copies;
+    double t = monotonic_seconds();
+    expire_old_backups(job, job.dest, ctx.mode, metrics);
+    return monotonic_seconds() - t;
+}
+
+static double timed_sync(const BenchContext &ctx) {
+    double t = monotonic_seconds();
+    run_command({"sync"}, ctx.mode);
+    return monotonic_seconds() - t;
+}
+
+// Rebuilds <dest> with the generated tree as 20200101 and current pointing
+// at it; not timed.
+static bool reset_dest(const BenchContext &ctx, const std::string &seed_tree) {
+    remove_dir_recursive(ctx.job.dest);
+    if (mkdir(ctx.job.dest.c_str(), 0755) != 0) return false;
+    if (!bench_copy_snapshot(seed_tree, ctx.job.dest + "/20200101", ctx.mode)) return false;
+    return symlink("20200101", (ctx.job.dest + "/current").c_str()) == 0;
+}
+
+// expire needs old snapshots to delete: hard-linked copies of the seed, as
+// successive backups of an unchanged tree would leave. They are dated before
+// 20200101 so current stays the newest and survives expiry.
+static bool add_old_snapshots(const BenchContext &ctx) {
+    for (int i = 1; i < ctx.snapshots; i++) {
+        std::string name = "2019010" + std::to_string(i);
+        if (!bench_copy_snapshot(ctx.job.dest + "/20200101", ctx.job.dest + "/" + name, ctx.mode)) return false;
+    }
+    return true;
+}
+
+static bool run_isolated(const BenchContext &ctx, const std::string &seed_tree, int iteration, std::vector<BenchResult> *results) {
+    std::string backup_dir = ctx.job.dest + "/20300101";
+    BenchResult r;
+    r.mode = "isolated";
+    r.iteration = iteration;
+
+    if (!reset_dest(ctx, seed_tree)) return false;
+    run_command({"sync"}, ctx.mode);
+    r.phase = "clone";
+    r.seconds = timed_clone(ctx, backup_dir);
+    results->push_back(r);
+
+    run_command({"sync"}, ctx.mode);
+    r.phase = "symlink_cleanup";
+    r.seconds = timed_symlink_cleanup(backup_dir);
+    results->push_back(r);
+
+    if (!reset_dest(ctx, seed_tree) || !add_old_snapshots(ctx)) return false;
+    run_command({"sync"}, ctx.mode);
+    JobMetrics metrics;
+    r.phase = "expire";
+    r.seconds = timed_expire(ctx, 1, &metrics);
+    r.bytes_reclaimed = metrics.bytes_reclaimed;
+    results->push_back(r);
+    r.bytes_reclaimed = 0;
+
+    if (!reset_dest(ctx, seed_tree)) return false;
+    r.phase = "sync";
+    r.seconds = timed_sync(ctx);
+    results->push_back(r);
+    return true;
+}
+
+// The order backup_job runs them: expire down to copies, clone current into
+// the new day, drop symlinks from the clone, then sync.
+static bool run_sequence(const BenchContext &ctx, const std::string &seed_tree, int iteration, std::vector<BenchResult> *results) {
+    if (!reset_dest(ctx, seed_tree) || !add_old_snapshots(ctx)) return false;
+    run_command({"sync"}, ctx.mode);
+    std::string backup_dir = ctx.job.dest + "/20300101";
+    BenchResult r;
+    r.mode = "sequence";
+    r.iteration = iteration;
+    double total = 0.0;
+
+    JobMetrics metrics;
+    r.phase = "expire";
+    r.seconds = timed_expire(ctx, ctx.snapshots - 1, &metrics);
+    r.bytes_reclaimed = metrics.bytes_reclaimed;
+    total += r.seconds;
+    results->push_back(r);
+    r.bytes_reclaimed = 0;
+
+    r.phase = "clone";
+    r.seconds = timed_clone(ctx, backup_dir);
+    total += r.seconds;
+    results->push_back(r);
+
+    r.phase = "symlink_cleanup";
+    r.seconds = timed_symlink_cleanup(backup_dir);
+    total += r.seconds;
+    results->push_back(r);
+
+    r.phase = "sync";
+    r.seconds = timed_sync(ctx);
+    total += r.seconds;
+    results->push_back(r);
+
+    r.phase = "total";
+    r.seconds = total;
+    results->push_back(r);
+    return true;
+}
+
+static void print_csv(FILE *out, const std::vector<BenchResult> &results) {
+    std::fprintf(out, "mode,phase,iteration,seconds,bytes_reclaimed\n");
+    for (const auto &r : results) {
+        std::fprintf(out, "%s,%s,%d,%.6f,%lld\n", r.mode.c_str(), r.phase.c_str(), r.iteration, r.seconds, r.bytes_reclaimed);
+    }
+}
+
+static void print_json(FILE *out, const BenchContext &ctx, const TreeStats &stats, const std::vector<BenchResult> &results) {
+    const TreeSpec &spec = ctx.spec;
+    std::fprintf(out, "{\n  \"tree\": {\"files\": %ld, \"min_size\": %lld, \"max_size\": %lld, \"depth\": %d, \"fanout\": %d, "
+        "\"hardlink_ratio\": %.4f, \"symlink_ratio\": %.4f, \"seed\": %llu, \"snapshots\": %d},\n",
+        spec.files, spec.min_size, spec.max_size, spec.depth, spec.fanout, spec.hardlink_ratio, spec.symlink_ratio,
+        static_cast<unsigned long long>(spec.seed), ctx.snapshots);
+    std::fprintf(out, "  \"generated\": {\"files\": %ld, \"hardlinks\": %ld, \"symlinks\": %ld, \"dirs\": %ld, \"bytes\": %lld},\n",
+        stats.files, stats.hardlinks, stats.symlinks, stats.dirs, stats.bytes);
+    std::fprintf(out, "  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        std::fprintf(out, "%s\n    {\"mode\": \"%s\", \"phase\": \"%s\", \"iteration\": %d, \"seconds\": %.6f, \"bytes_reclaimed\": %lld}",
+            i ? "," : "", r.mode.c_str(), r.phase.c_str(), r.iteration, r.seconds, r.bytes_reclaimed);
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+static void usage() {
+    std::printf("usage: timevault_bench [--files N] [--min-size BYTES] [--max-size BYTES] [--depth N] [--fanout N]\n"
+        "                       [--hardlink-ratio R] [--symlink-ratio R] [--seed N] [--snapshots N]\n"
+        "                       [--iterations N] [--format csv|json] [--dir PATH] [--keep] [--verbose]\n");
+}
+
+static bool parse_number(const char *text, double lo, double hi, double *value) {
+    char *end = nullptr;
+    double v = std::strtod(text, &end);
+    if (!end || *end != '\0' || v < lo || v > hi) return false;
+    *value = v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    BenchContext ctx;
+    int iterations = 3;
+    std::string format = "csv";
+    bool keep = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        double v = 0.0;
+        bool has_value = i + 1 < argc;
+        if (arg == "--files" && has_value && parse_number(argv[i + 1], 1, 1e8, &v)) {
+            ctx.spec.files = static_cast<long>(v);
+        } else if (arg == "--min-size" && has_value && parse_number(argv[i + 1], 0, 1e12, &v)) {
+            ctx.spec.min_size = static_cast<long long>(v);
+        } else if (arg == "--max-size" && has_value && parse_number(argv[i + 1], 0, 1e12, &v)) {
+            ctx.spec.max_size = static_cast<long long>(v);
+        } else if (arg == "--depth" && has_value && parse_number(argv[i + 1], 0, 8, &v)) {
+            ctx.spec.depth = static_cast<int>(v);
+        } else if (arg == "--fanout" && has_value && parse_number(argv[i + 1], 1, 256, &v)) {
+            ctx.spec.fanout = static_cast<int>(v);
+        } else if (arg == "--hardlink-ratio" && has_value && parse_number(argv[i + 1], 0, 1, &v)) {
+            ctx.spec.hardlink_ratio = v;
+        } else if (arg == "--symlink-ratio" && has_value && parse_number(argv[i + 1], 0, 1, &v)) {
+            ctx.spec.symlink_ratio = v;
+        } else if (arg == "--seed" && has_value && parse_number(argv[i + 1], 0, 1e18, &v)) {
+            ctx.spec.seed = static_cast<uint64_t>(v);
+        } else if (arg == "--snapshots" && has_value && parse_number(argv[i + 1], 2, 9, &v)) {
+            ctx.snapshots = static_cast<int>(v);
+        } else if (arg == "--iterations" && has_value && parse_number(argv[i + 1], 1, 1000, &v)) {
+            iterations = static_cast<int>(v);
+        } else if (arg == "--format" && has_value && (std::strcmp(argv[i + 1], "csv") == 0 || std::strcmp(argv[i + 1], "json") == 0)) {
+            format = argv[i + 1];
+        } else if (arg == "--dir" && has_value) {
+            ctx.dir = argv[i + 1];
+        } else if (arg == "--keep") {
+            keep = true;
+            continue;
+        } else if (arg == "--verbose") {
+            ctx.mode.verbose = true;
+            continue;
+        } else {
+            usage();
+            return 2;
+        }
+        i++;
+    }
+    if (ctx.spec.hardlink_ratio + ctx.spec.symlink_ratio > 1.0) {
+        std::printf("--hardlink-ratio and --symlink-ratio must add up to at most 1\n");
+        return 2;
+    }
+
+    // Always a fresh directory of our own, since it is removed afterwards;
+    // --dir only picks where it is created.
+    std::string parent = ctx.dir.empty() ? "/tmp" : ctx.dir;
+    if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::printf("cannot create %s: %s\n", parent.c_str(), std::strerror(errno));
+        return 2;
+    }
+    std::string tmpl = parent + "/timevault-bench.XXXXXX";
+    if (!mkdtemp(&tmpl[0])) {
+        std::printf("cannot create work directory in %s: %s\n", parent.c_str(), std::strerror(errno));
+        return 2;
+    }
+    ctx.dir = tmpl;
+    ctx.job.name = "bench";
+    ctx.job.dest = ctx.dir + "/dest";
+
+    // Phase code prints progress (delete: ...) to stdout; keep results on
+    // the real stdout and send the rest to /dev/null unless --verbose.
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) return 2;
+    if (!ctx.mode.verbose) {
+        int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null_fd >= 0) {
+            std::fflush(stdout);
+            dup2(null_fd, STDOUT_FILENO);
+            ::close(null_fd);
+        }
+    }
+
+    std::string seed_tree = ctx.dir + "/seed";
+    TreeStats stats;
+    if (!generate_tree(seed_tree, ctx.spec, &stats)) {
+        std::fprintf(stderr, "cannot generate tree in %s: %s\n", seed_tree.c_str(), std::strerror(errno));
+        return 2;
+    }
+    std::fprintf(stderr, "generated %ld files, %ld hardlinks, %ld symlinks, %ld dirs, %lld bytes in %s\n",
+        stats.files, stats.hardlinks, stats.symlinks, stats.dirs, stats.bytes, seed_tree.c_str());
+
+    std::vector<BenchResult> results;
+    bool ok = true;
+    for (int it = 1; ok && it <= iterations; it++) {
+        ok = run_isolated(ctx, seed_tree, it, &results) && run_sequence(ctx, seed_tree, it, &results);
+    }
+    if (!ok) {
+        std::fprintf(stderr, "benchmark failed in %s: %s\n", ctx.dir.c_str(), std::strerror(errno));
+    }
+    if (format == "json") {
+        print_json(out, ctx, stats, results);
+    } else {
+        print_csv(out, results);
+    }
+    std::fclose(out);
+    if (!keep) remove_dir_recursive(ctx.dir);
+    return ok ? 0 : 1;
+}
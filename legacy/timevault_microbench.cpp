@@ -0,0 +1,359 @@
+// Microbenchmarks for the orchestration paths of the legacy C++ binary:
+// config parsing, dependency resolution and mount table lookups, on
+// generated configs and mount tables of increasing size.
+//
+//   g++ -std=c++17 -O2 -pthread legacy/timevault_microbench.cpp -lyaml-cpp -lz -o /tmp/timevault_microbench
+//   /tmp/timevault_microbench --sizes 10,100,1000,10000 --min-time 0.2
+
+// The CLI entry points of timevault.cpp go unused here.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#define TIMEVAULT_NO_MAIN
+#include "timevault.cpp"
+#pragma GCC diagnostic pop
+
+#include <new>
+
+// Every allocation in the process goes through these, so allocs/op is the
+// number of operator new calls made while the benchmark body runs. All
+// forms are replaced, aligned and nothrow included, so each delete frees
+// with the allocator its new used. The pair are kept out of line: once
+// inlined into a caller GCC sees free() on a pointer from operator new and
+// warns of a mismatch that the replacement rules out.
+static std::atomic<uint64_t> alloc_count{0};
+
+__attribute__((noinline)) static void *counted_alloc(size_t size, size_t align) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (align <= alignof(std::max_align_t)) return std::malloc(size);
+    return std::aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+__attribute__((noinline)) static void counted_free(void *p) {
+    std::free(p);
+}
+
+void *operator new(size_t size) {
+    if (void *p = counted_alloc(size, 0)) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return ::operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    if (void *p = counted_alloc(size, static_cast<size_t>(align))) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return ::operator new(size, align);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void *p) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
+
+struct MicroResult {
+    std::string name;
+    size_t size = 0;
+    uint64_t ops = 0;
+    double ns_per_op = 0.0;
+    double allocs_per_op = 0.0;
+};
+
+static double bench_min_time = 0.2;
+static bool bench_failed = false;
+static std::string bench_filter;
+
+static bool bench_wanted(const std::string &name) {
+    return bench_filter.empty() || name.find(bench_filter) != std::string::npos;
+}
+
+// Runs body until min_time has passed (at least once) and reports the mean.
+template <typename F>
+static MicroResult run_micro(const std::string &name, size_t size, F body) {
+    MicroResult r;
+    r.name = name;
+    r.size = size;
+    if (!body()) {
+        std::fprintf(stderr, "%s/%zu failed\n", name.c_str(), size);
+        bench_failed = true;
+        return r;
+    }
+    uint64_t batch = 1;
+    double elapsed = 0.0;
+    uint64_t allocs = 0;
+    while (elapsed < bench_min_time) {
+        uint64_t before = alloc_count.load(std::memory_order_relaxed);
+        double t = monotonic_seconds();
+        for (uint64_t i = 0; i < batch; i++) body();
+        elapsed += monotonic_seconds() - t;
+        allocs += alloc_count.load(std::memory_order_relaxed) - before;
+        r.ops += batch;
+        if (batch < (1u << 20)) batch *= 2;
+    }
+    r.ns_per_op = elapsed * 1e9 / static_cast<double>(r.ops);
+    r.allocs_per_op = static_cast<double>(allocs) / static_cast<double>(r.ops);
+    return r;
+}
+
+// Appends run_micro's result unless --filter excludes the benchmark, in
+// which case body never runs.
+template <typename F>
+static void add_micro(std::vector<MicroResult> *results, const std::string &name, size_t size, F body) {
+    if (bench_wanted(name)) results->push_back(run_micro(name, size, body));
+}
+
+// Same shape as bench-config-scale.sh: jobs depend on later jobs in the
+// file, chained in groups of 50, spread over 6 disks.
+static std::string generate_config(size_t jobs) {
+    std::string out = "jobs:\n";
+    char buf[256];
+    for (size_t i = 0; i < jobs; i++) {
+        size_t disk = i % 6;
+        std::snprintf(buf, sizeof(buf),
+            "  - name: job%05zu\n    source: /srv/data/%05zu/\n    dest: /mnt/backup%zu/job%05zu\n"
+            "    mount: /mnt/backup%zu\n    copies: 7\n",
+            i, i, disk, i, disk);
+        out += buf;
+        size_t dep = jobs;
+        if (i % 50 != 49 && i + 1 < jobs) {
+            dep = i + 1;
+        } else if (i % 50 == 49 && i + 50 < jobs) {
+            dep = i + 50;
+        }
+        if (dep < jobs) {
+            std::snprintf(buf, sizeof(buf), "    depends_on:\n      - job%05zu\n", dep);
+            out += buf;
+        }
+    }
+    return out;
+}
+
+// fstab and /proc/mounts share the same layout for the fields looked at.
+static std::string generate_mount_table(size_t entries) {
+    std::string out = "# generated\n";
+    char buf[256];
+    for (size_t i = 0; i < entries; i++) {
+        std::snprintf(buf, sizeof(buf), "/dev/disk%zu /mnt/backup%zu ext4 rw,relatime 0 0\n", i, i);
+        out += buf;
+    }
+    return out;
+}
+
+static bool write_text(const std::string &path, const std::string &text) {
+    FILE *f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+    bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+static std::vector<size_t> parse_sizes(const std::string &text) {
+    std::vector<size_t> sizes;
+    const char *p = text.c_str();
+    for (;;) {
+        char *end = nullptr;
+        unsigned long v = std::strtoul(p, &end, 10);
+        if (end == p || v == 0 || (*end != ',' && *end != '\0')) return {};
+        sizes.push_back(v);
+        if (*end == '\0') return sizes;
+        p = end + 1;
+    }
+}
+
+static void bench_config(const std::string &dir, size_t jobs, std::vector<MicroResult> *results) {
+    if (!bench_wanted("parse_config") && !bench_wanted("validate_job_names") && !bench_wanted("build_job_graph") &&
+        !bench_wanted("collect_jobs_with_deps") && !bench_wanted("topo_sort_jobs/mount_affinity")) {
+        return;
+    }
+    std::string path = dir + "/timevault-" + std::to_string(jobs) + ".yaml";
+    if (!write_text(path, generate_config(jobs))) {
+        std::fprintf(stderr, "cannot write %s: %s\n", path.c_str(), std::strerror(errno));
+        bench_failed = true;
+        return;
+    }
+    std::string err;
+    add_micro(results, "parse_config", jobs, [&]() {
+        Config cfg;
+        return parse_config(path, &cfg, &err);
+    });
+
+    Config cfg;
+    if (!parse_config(path, &cfg, &err)) return;
+    add_micro(results, "validate_job_names", jobs, [&]() {
+        return validate_job_names(cfg, &err);
+    });
+
+    // Later benchmarks need the graph and included set even when the ones
+    // that build them are filtered out.
+    JobGraph graph;
+    if (!build_job_graph(cfg, &graph, &err)) return;
+    add_micro(results, "build_job_graph", jobs, [&]() {
+        return build_job_graph(cfg, &graph, &err);
+    });
+
+    // All jobs as roots is the --print-order / full-run case.
+    std::vector<std::string> roots;
+    for (const auto &job : cfg.jobs) roots.push_back(job.name);
+    std::vector<int> included(cfg.jobs.size(), 0);
+    if (!collect_jobs_with_deps(cfg, graph, roots, &included, &err)) return;
+    add_micro(results, "collect_jobs_with_deps", jobs, [&]() {
+        std::fill(included.begin(), included.end(), 0);
+        return collect_jobs_with_deps(cfg, graph, roots, &included, &err);
+    });
+
+    std::vector<int> order;
+    add_micro(results, "topo_sort_jobs", jobs, [&]() {
+        return topo_sort_jobs(cfg, graph, included, false, &order, &err);
+    });
+    add_micro(results, "topo_sort_jobs/mount_affinity", jobs, [&]() {
+        return topo_sort_jobs(cfg, graph, included, true, &order, &err);
+    });
+}
+
+// Lookups are for the last entry, the worst case for a linear scan; a miss
+// costs the same.
+static void bench_mounts(const std::string &dir, size_t entries, std::vector<MicroResult> *results) {
+    if (!bench_wanted("mount_is_mounted") && !bench_wanted("mount_in_fstab")) return;
+    std::string path = dir + "/mounts-" + std::to_string(entries);
+    if (!write_text(path, generate_mount_table(entries))) {
+        std::fprintf(stderr, "cannot write %s: %s\n", path.c_str(), std::strerror(errno));
+        bench_failed = true;
+        return;
+    }
+    std::string mount = "/mnt/backup" + std::to_string(entries - 1);
+    FSTAB_PATH = path.c_str();
+    MOUNTS_PATH = path.c_str();
+    add_micro(results, "mount_is_mounted", entries, [&]() {
+        return mount_is_mounted(mount);
+    });
+    add_micro(results, "mount_in_fstab", entries, [&]() {
+        return mount_in_fstab(mount);
+    });
+    FSTAB_PATH = "/etc/fstab";
+    MOUNTS_PATH = "/proc/mounts";
+}
+
+static void usage() {
+    std::printf("usage: timevault_microbench [--sizes N,N,...] [--min-time SECONDS] [--filter SUBSTRING] [--format table|csv]\n");
+}
+
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes = {10, 100, 1000, 10000};
+    std::string format = "table";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes = parse_sizes(argv[++i]);
+            if (sizes.empty()) {
+                usage();
+                return 2;
+            }
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            bench_min_time = std::strtod(argv[++i], nullptr);
+            if (bench_min_time <= 0.0) {
+                usage();
+                return 2;
+            }
+        } else if (arg == "--filter" && i + 1 < argc) {
+            bench_filter = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc && (std::strcmp(argv[i + 1], "table") == 0 || std::strcmp(argv[i + 1], "csv") == 0)) {
+            format = argv[++i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/timevault-microbench.XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::fprintf(stderr, "cannot create work directory: %s\n", std::strerror(errno));
+        return 2;
+    }
+    std::string dir = tmpl;
+
+    std::vector<MicroResult> results;
+    for (size_t size : sizes) {
+        bench_config(dir, size, &results);
+        bench_mounts(dir, size, &results);
+    }
+    remove_dir_recursive(dir);
+
+    if (format == "csv") {
+        std::printf("benchmark,size,ops,ns_per_op,allocs_per_op\n");
+        for (const auto &r : results) {
+            std::printf("%s,%zu,%llu,%.1f,%.1f\n", r.name.c_str(), r.size,
+                static_cast<unsigned long long>(r.ops), r.ns_per_op, r.allocs_per_op);
+        }
+    } else {
+        std::printf("%-30s %7s %10s %14s %12s\n", "benchmark", "size", "ops", "ns/op", "allocs/op");
+        for (const auto &r : results) {
+            std::printf("%-30s %7zu %10llu %14.1f %12.1f\n", r.name.c_str(), r.size,
+                static_cast<unsigned long long>(r.ops), r.ns_per_op, r.allocs_per_op);
+        }
+    }
+    return bench_failed ? 1 : 0;
+}